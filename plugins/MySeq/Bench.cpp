@@ -0,0 +1,291 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+// Player micro-benchmark. Sweeps one parameter at a time around a baseline configuration
+// and reports the cost of a block as run_player1 does it: Player::run plus the MIDI output buffer.
+//
+//   MySeq-bench [--quick] [--csv <file>]
+//
+// Patterns are filled with random notes from a fixed seed, so runs are comparable between builds.
+// Pattern i is triggered by note i % triggers, so every trigger note starts patterns / triggers
+// of them (at most MAX_ACTIVE_PATTERNS are playing, the "active" column shows how many are).
+// The sweeps are followed by a comparison of the column scan kernels, see ColumnScan.hpp,
+// and of saving and loading the state as JSON and in the binary format.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "Patterns.hpp"
+#include "Player.hpp"
+#include "MidiOutBuffer.hpp"
+#include "ColumnScan.hpp"
+
+namespace {
+
+    struct BenchConfig {
+        const char *sweep;
+        int patterns;
+        double density;
+        int width;
+        // 0 for a mix of 0.5, 1 and 2
+        float speed;
+        uint32_t block_size;
+        int triggers;
+    };
+
+    struct BenchResult {
+        std::size_t active;
+        double mean_ns;
+        double p50_ns;
+        double p99_ns;
+        double max_ns;
+        double events_per_sec;
+    };
+
+    constexpr double SAMPLE_RATE = 48000.0;
+    constexpr double BPM = 120.0;
+    constexpr double TICKS_PER_BEAT = 1920.0;
+
+    myseq::State make_state(const BenchConfig &config) {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<double> chance(0.0, 1.0);
+        std::uniform_int_distribution<int> velocity(1, 127);
+        const float speeds[] = {0.5f, 1.0f, 2.0f};
+        myseq::State state;
+        for (int i = 0; i < config.patterns; i++) {
+            auto &p = state.create_pattern();
+            p.resize_width(config.width);
+            p.set_note_trigger_range(i % config.triggers, 1);
+            p.set_speed(config.speed > 0.0f ? config.speed : speeds[i % 3]);
+            // notes in a two octave band, like a typical pattern
+            for (int x = 0; x < config.width; x++) {
+                for (int y = 40; y < 64; y++) {
+                    if (chance(rng) < config.density) {
+                        p.set_velocity(myseq::V2i(x, y), (uint8_t) velocity(rng));
+                    }
+                }
+            }
+        }
+        state.rebuild_trigger_table();
+        state.play_note_triggered = true;
+        state.prepare_for_realtime(0);
+        return state;
+    }
+
+    BenchResult run_bench(const BenchConfig &config, int blocks) {
+        const auto state = make_state(config);
+        const double frames_per_tick = SAMPLE_RATE / (BPM / 60.0 * TICKS_PER_BEAT);
+        myseq::Player player;
+        myseq::MidiOutBuffer midi_out;
+        myseq::TimeParams tp{0.0, TICKS_PER_BEAT / 4.0, config.block_size / frames_per_tick, true, 0};
+        for (int n = 0; n < config.triggers; n++) {
+            player.start_note_triggered(state, myseq::Note((uint8_t) n, 0), 100, 0.0, tp);
+        }
+
+        const int warmup = blocks / 10;
+        std::vector<double> times;
+        times.reserve(blocks);
+        std::size_t events = 0;
+        double total_ns = 0.0;
+        for (int i = 0; i < warmup + blocks; i++) {
+            tp.time = i * tp.window;
+            tp.iteration = i;
+            const auto start = std::chrono::steady_clock::now();
+            player.run([&](uint8_t note, uint8_t velocity, double time) {
+                midi_out.push(myseq::block_frame(time, frames_per_tick, config.block_size), note, velocity);
+            }, state, tp);
+            midi_out.finish_block();
+            std::size_t written = 0;
+            midi_out.write([&](const myseq::MidiOutEvent &) {
+                written++;
+                return true;
+            });
+            const auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if (i >= warmup) {
+                times.push_back(ns);
+                total_ns += ns;
+                events += written;
+            }
+        }
+
+        std::sort(times.begin(), times.end());
+        const auto percentile = [&](double q) {
+            return times[std::min(times.size() - 1, (std::size_t) (q * (double) times.size()))];
+        };
+        return {player.active_patterns.size(), total_ns / (double) blocks, percentile(0.5), percentile(0.99),
+                times.back(), total_ns > 0.0 ? (double) events / (total_ns * 1e-9) : 0.0};
+    }
+
+    // Every cell of a 32 x 128 pattern holds a note, one in eight with velocity 0.
+    // Compares finding the playable note starts cell by cell with the column scan kernels
+    void bench_column_scan(int repeats) {
+        std::mt19937 rng(1);
+        myseq::Pattern p(0);
+        for (int x = 0; x < p.width; x++) {
+            for (int y = 0; y < p.height; y++) {
+                p.set_velocity(myseq::V2i(x, y), rng() % 8 == 0 ? 0 : (uint8_t) (1 + rng() % 127));
+            }
+        }
+        std::vector<myseq::ScheduledNote> out(p.width * p.height);
+        auto time_scan = [&](const char *name, auto scan) {
+            std::size_t found = 0;
+            const auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeats; r++) {
+                found = scan();
+            }
+            const auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()
+                            / repeats;
+            printf("%-10s %10.0f %12zu %12.2f\n", name, ns, found, ns / (double) (p.width * p.height));
+        };
+
+        printf("\ncolumn scan, %dx%d pattern, best kernel: %s\n", p.width, p.height,
+               myseq::scan_kernel_name(myseq::best_scan_kernel()));
+        printf("%-10s %10s %12s %12s\n", "method", "ns/pattern", "note starts", "ns/cell");
+        time_scan("per cell", [&]() {
+            std::size_t n = 0;
+            for (int x = 0; x < p.width; x++) {
+                for (int y = 0; y < p.height; y++) {
+                    const auto v = myseq::V2i(x, y);
+                    if (p.exists(v) && !p.is_extension_of_tied(v) && p.get_velocity(v) > 0) {
+                        out[n++] = {x, myseq::utils::row_index_to_midi_note(y), p.get_velocity(v), p.get_length(v)};
+                    }
+                }
+            }
+            return n;
+        });
+        for (const auto kernel: {myseq::ScanKernel::Scalar, myseq::ScanKernel::Sse2, myseq::ScanKernel::Avx2}) {
+            const auto fn = myseq::nonzero_mask_kernel(kernel);
+            if (fn == nullptr) {
+                continue;
+            }
+            time_scan(myseq::scan_kernel_name(kernel), [&]() {
+                std::size_t n = 0;
+                for (int x = 0; x < p.width; x++) {
+                    n += p.collect_note_starts(x, out.data() + n, fn);
+                }
+                return n;
+            });
+        }
+    }
+
+    // Patterns of 256 steps at density 0.2, about 1200 notes each. The sizes are of the encoded state
+    void bench_serialize(int patterns, int repeats) {
+        const auto state = make_state({"", patterns, 0.2, 256, 1.0f, 256, 16});
+        const auto json = state.to_json_string();
+        const auto binary = state.to_binary();
+        const auto base64 = state.to_base64();
+        auto time_it = [&](const char *name, std::size_t size, auto f) {
+            const auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeats; r++) {
+                f();
+            }
+            const auto us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()
+                            / repeats;
+            printf("%-14s %10zu %12.1f\n", name, size, us);
+        };
+
+        std::size_t notes = 0;
+        state.each_pattern([&](const myseq::Pattern &p) {
+            p.each_cell([&](const myseq::Cell &) {
+                notes++;
+            });
+        });
+        printf("\nstate encoding, %d patterns of 256 steps, %zu notes\n", patterns, notes);
+        printf("%-14s %10s %12s\n", "method", "bytes", "us");
+        time_it("json write", json.size(), [&]() { return state.to_json_string(); });
+        time_it("json read", json.size(), [&]() { return myseq::State::from_json_string(json.c_str()); });
+        time_it("binary write", binary.size(), [&]() { return state.to_binary(); });
+        time_it("binary read", binary.size(), [&]() { return myseq::State::from_binary(binary.data(), binary.size()); });
+        time_it("binary decode", binary.size(), [&]() {
+            auto loaded = myseq::State::from_binary(binary.data(), binary.size());
+            loaded.decode_all();
+            return loaded;
+        });
+        time_it("base64 write", base64.size(), [&]() { return state.to_base64(); });
+        time_it("base64 read", base64.size(), [&]() { return myseq::State::from_string(base64); });
+    }
+
+    std::vector<BenchConfig> make_sweeps(bool quick) {
+        const BenchConfig base = {"", 64, 0.05, 32, 1.0f, 256, 16};
+        std::vector<BenchConfig> configs;
+        auto sweep = [&](const char *name, auto values, auto set) {
+            for (auto v: values) {
+                auto c = base;
+                c.sweep = name;
+                set(c, v);
+                configs.push_back(c);
+            }
+        };
+        if (quick) {
+            sweep("patterns", std::vector<int>{1, 64, 1000}, [](BenchConfig &c, int v) { c.patterns = v; });
+            sweep("block_size", std::vector<uint32_t>{16, 4096}, [](BenchConfig &c, uint32_t v) { c.block_size = v; });
+            return configs;
+        }
+        sweep("patterns", std::vector<int>{1, 10, 64, 100, 256, 500, 1000},
+              [](BenchConfig &c, int v) { c.patterns = v; });
+        sweep("density", std::vector<double>{0.0, 0.01, 0.05, 0.2, 0.5, 1.0},
+              [](BenchConfig &c, double v) { c.density = v; });
+        sweep("width", std::vector<int>{4, 16, 32, 64, 128, 256, 1024, 4096},
+              [](BenchConfig &c, int v) { c.width = v; });
+        sweep("speed", std::vector<float>{0.25f, 0.5f, 1.0f, 2.0f, 4.0f, 0.0f},
+              [](BenchConfig &c, float v) { c.speed = v; });
+        sweep("block_size", std::vector<uint32_t>{16, 32, 64, 128, 256, 512, 1024, 2048, 4096},
+              [](BenchConfig &c, uint32_t v) { c.block_size = v; });
+        sweep("triggers", std::vector<int>{1, 4, 16, 64, 128},
+              [](BenchConfig &c, int v) { c.triggers = v; });
+        return configs;
+    }
+}
+
+int main(int argc, char **argv) {
+    bool quick = false;
+    const char *csv_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if (std::strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csv_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--csv <file>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    FILE *csv = nullptr;
+    if (csv_path != nullptr) {
+        csv = fopen(csv_path, "w");
+        if (csv == nullptr) {
+            fprintf(stderr, "could not open %s\n", csv_path);
+            return 1;
+        }
+        fprintf(csv, "sweep,patterns,density,width,speed,block_size,triggers,active,"
+                     "mean_ns,p50_ns,p99_ns,max_ns,events_per_sec\n");
+    }
+
+    printf("%-10s %8s %7s %5s %5s %6s %8s %6s %10s %10s %10s %10s %12s\n", "sweep", "patterns", "density",
+           "width", "speed", "block", "triggers", "active", "ns/block", "p50", "p99", "max", "events/sec");
+    const int blocks = quick ? 2000 : 20000;
+    for (const auto &c: make_sweeps(quick)) {
+        const auto r = run_bench(c, blocks);
+        printf("%-10s %8d %7.2f %5d %5.2f %6u %8d %6zu %10.0f %10.0f %10.0f %10.0f %12.0f\n", c.sweep, c.patterns,
+               c.density, c.width, c.speed, c.block_size, c.triggers, r.active, r.mean_ns, r.p50_ns, r.p99_ns,
+               r.max_ns, r.events_per_sec);
+        if (csv != nullptr) {
+            fprintf(csv, "%s,%d,%g,%d,%g,%u,%d,%zu,%.1f,%.1f,%.1f,%.1f,%.0f\n", c.sweep, c.patterns, c.density,
+                    c.width, c.speed, c.block_size, c.triggers, r.active, r.mean_ns, r.p50_ns, r.p99_ns, r.max_ns,
+                    r.events_per_sec);
+        }
+    }
+    if (csv != nullptr) {
+        fclose(csv);
+    }
+    bench_column_scan(quick ? 200 : 2000);
+    bench_serialize(8, quick ? 20 : 200);
+    bench_serialize(64, quick ? 5 : 50);
+    return 0;
+}
@@ -0,0 +1,153 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#include <random>
+#include <vector>
+#include "MyAssert.hpp"
+#include "ColumnScan.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MYSEQ_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace myseq {
+
+    namespace {
+
+        void scalar_tail(const uint8_t *values, std::size_t from, std::size_t n, uint64_t *out) {
+            if (from >= n) {
+                return;
+            }
+            uint64_t word = 0;
+            for (auto i = from; i < n; i++) {
+                word |= static_cast<uint64_t>(values[i] > 0) << (i & 63);
+            }
+            out[from / 64] = word;
+        }
+
+        void nonzero_mask_scalar(const uint8_t *values, std::size_t n, uint64_t *out) {
+            const auto full = n & ~static_cast<std::size_t>(63);
+            for (std::size_t i = 0; i < full; i += 64) {
+                uint64_t word = 0;
+                for (std::size_t j = 0; j < 64; j++) {
+                    word |= static_cast<uint64_t>(values[i + j] > 0) << j;
+                }
+                out[i / 64] = word;
+            }
+            scalar_tail(values, full, n, out);
+        }
+
+#ifdef MYSEQ_SCAN_X86
+
+        __attribute__((target("sse2")))
+        void nonzero_mask_sse2(const uint8_t *values, std::size_t n, uint64_t *out) {
+            const auto zero = _mm_setzero_si128();
+            const auto full = n & ~static_cast<std::size_t>(63);
+            for (std::size_t i = 0; i < full; i += 64) {
+                uint64_t zeros = 0;
+                for (int j = 0; j < 4; j++) {
+                    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i + 16 * j));
+                    const auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+                    zeros |= static_cast<uint64_t>(mask) << (16 * j);
+                }
+                out[i / 64] = ~zeros;
+            }
+            scalar_tail(values, full, n, out);
+        }
+
+        __attribute__((target("avx2")))
+        void nonzero_mask_avx2(const uint8_t *values, std::size_t n, uint64_t *out) {
+            const auto zero = _mm256_setzero_si256();
+            const auto full = n & ~static_cast<std::size_t>(63);
+            for (std::size_t i = 0; i < full; i += 64) {
+                const auto lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i));
+                const auto hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i + 32));
+                const auto lo_zeros = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero)));
+                const auto hi_zeros = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zero)));
+                out[i / 64] = ~(static_cast<uint64_t>(lo_zeros) | static_cast<uint64_t>(hi_zeros) << 32);
+            }
+            scalar_tail(values, full, n, out);
+        }
+
+#endif
+
+        ScanKernel pick_scan_kernel() {
+#ifdef MYSEQ_SCAN_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return ScanKernel::Avx2;
+            }
+            if (__builtin_cpu_supports("sse2")) {
+                return ScanKernel::Sse2;
+            }
+#endif
+            return ScanKernel::Scalar;
+        }
+
+        // Resolved during static initialization, so the audio thread never races on it
+        const ScanKernel best_kernel = pick_scan_kernel();
+        const NonzeroMaskFn best_kernel_fn = nonzero_mask_kernel(best_kernel);
+    }
+
+    NonzeroMaskFn nonzero_mask_kernel(ScanKernel kernel) {
+        switch (kernel) {
+            case ScanKernel::Scalar:
+                return nonzero_mask_scalar;
+#ifdef MYSEQ_SCAN_X86
+            case ScanKernel::Sse2:
+                return __builtin_cpu_supports("sse2") ? nonzero_mask_sse2 : nullptr;
+            case ScanKernel::Avx2:
+                return __builtin_cpu_supports("avx2") ? nonzero_mask_avx2 : nullptr;
+#endif
+            default:
+                return nullptr;
+        }
+    }
+
+    ScanKernel best_scan_kernel() {
+        return best_kernel;
+    }
+
+    const char *scan_kernel_name(ScanKernel kernel) {
+        switch (kernel) {
+            case ScanKernel::Scalar:
+                return "scalar";
+            case ScanKernel::Sse2:
+                return "sse2";
+            case ScanKernel::Avx2:
+                return "avx2";
+        }
+        return "?";
+    }
+
+    void nonzero_mask(const uint8_t *values, std::size_t n, uint64_t *out) {
+        best_kernel_fn(values, n, out);
+    }
+
+    void test_column_scan() {
+        std::mt19937 rng(7);
+        std::vector<uint8_t> values(300);
+        for (auto &v: values) {
+            v = rng() % 3 == 0 ? 0 : static_cast<uint8_t>(rng());
+        }
+        for (const auto kernel: {ScanKernel::Scalar, ScanKernel::Sse2, ScanKernel::Avx2}) {
+            const auto fn = nonzero_mask_kernel(kernel);
+            if (fn == nullptr) {
+                continue;
+            }
+            // every length around the word boundaries, starting at unaligned addresses
+            for (std::size_t offset = 0; offset < 3; offset++) {
+                for (std::size_t n = 0; n <= 200; n++) {
+                    uint64_t out[4] = {};
+                    fn(values.data() + offset, n, out);
+                    for (std::size_t i = 0; i < n; i++) {
+                        assert(((out[i / 64] >> (i % 64)) & 1) == (values[offset + i] > 0));
+                    }
+                }
+            }
+        }
+        assert(nonzero_mask_kernel(best_scan_kernel()) != nullptr);
+    }
+}
@@ -0,0 +1,37 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_COLUMNSCAN_HPP
+#define MY_PLUGINS_COLUMNSCAN_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace myseq {
+
+    void test_column_scan();
+
+    enum class ScanKernel {
+        Scalar,
+        Sse2,
+        Avx2,
+    };
+
+    // Sets bit i % 64 of out[i / 64] when values[i] > 0 and clears it otherwise, for i < n.
+    // out needs room for (n + 63) / 64 words
+    using NonzeroMaskFn = void (*)(const uint8_t *values, std::size_t n, uint64_t *out);
+
+    // nullptr if this build or CPU does not have it
+    NonzeroMaskFn nonzero_mask_kernel(ScanKernel kernel);
+
+    // Fastest kernel the CPU supports, picked once at startup
+    ScanKernel best_scan_kernel();
+
+    const char *scan_kernel_name(ScanKernel kernel);
+
+    // Runs the kernel of best_scan_kernel()
+    void nonzero_mask(const uint8_t *values, std::size_t n, uint64_t *out);
+}
+
+#endif //MY_PLUGINS_COLUMNSCAN_HPP
@@ -0,0 +1,52 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_COW_HPP
+#define MY_PLUGINS_COW_HPP
+
+#include <atomic>
+#include <memory>
+
+namespace myseq {
+
+    // A value that copies share until one of them is mutated: copying a Cow copies a pointer,
+    // mutate() copies the value first if another Cow still points to it.
+    //
+    // Copies can live on different threads, each thread only touching its own Cow
+    template<typename T>
+    class Cow {
+        std::shared_ptr<T> ptr;
+
+    public:
+        explicit Cow(T value) : ptr(std::make_shared<T>(std::move(value))) {}
+
+        const T &operator*() const {
+            return *ptr;
+        }
+
+        const T *operator->() const {
+            return ptr.get();
+        }
+
+        T &mutate() {
+            if (ptr.use_count() != 1) {
+                ptr = std::make_shared<T>(*ptr);
+            } else {
+                // pairs with the release of the last other owner, whose reads must be done before we write
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+            return *ptr;
+        }
+
+        [[nodiscard]] bool is_shared() const {
+            return ptr.use_count() != 1;
+        }
+
+        [[nodiscard]] bool shares_with(const Cow &other) const {
+            return ptr == other.ptr;
+        }
+    };
+}
+
+#endif //MY_PLUGINS_COW_HPP
@@ -0,0 +1,410 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#include "Edits.hpp"
+
+namespace myseq {
+
+    namespace {
+
+        EditOp make_op(EditOp::Type type, int pattern_id) {
+            EditOp op{};
+            op.type = type;
+            op.pattern_id = pattern_id;
+            return op;
+        }
+
+        EditOp make_cell_op(EditOp::Type type, int pattern_id, const V2i &position) {
+            auto op = make_op(type, pattern_id);
+            op.x = position.x;
+            op.y = position.y;
+            return op;
+        }
+
+        // The cell whose note starts at v, nothing for empty cells and extensions of tied notes
+        std::optional<Cell> cell_starting_at(const Pattern &p, const V2i &v) {
+            if (!p.exists(v) || p.is_extension_of_tied(v)) {
+                return {};
+            }
+            return p.get_cell(v);
+        }
+
+        void diff_patterns(const Pattern &from, const Pattern &to, std::vector<EditOp> &out) {
+            // a pattern that is still encoded reads as empty
+            if (!from.is_decoded() || !to.is_decoded()) {
+                diff_patterns(from.decoded(), to.decoded(), out);
+                return;
+            }
+            const auto id = to.id;
+            // cells are compared against what the receiver has after Resize: the cells of `from`
+            // before the new width, cut at it, and the lane events before the new end
+            if (from.width != to.width) {
+                auto op = make_op(EditOp::Type::Resize, id);
+                op.a = to.width;
+                out.push_back(op);
+            }
+            auto from_cell = [&](const V2i &v) -> std::optional<Cell> {
+                auto c = v.x < to.width ? cell_starting_at(from, v) : std::nullopt;
+                if (c.has_value()) {
+                    c->length = std::min(c->length, to.width - v.x);
+                }
+                return c;
+            };
+            auto each_from_cell = [&](auto f) {
+                from.each_cell([&](const Cell &c) {
+                    if (c.position.x < to.width) {
+                        f(Cell{c.position, c.velocity, std::min(c.length, to.width - c.position.x)});
+                    }
+                });
+            };
+            if (from.get_first_note() != to.get_first_note() || from.get_last_note() != to.get_last_note()) {
+                auto op = make_op(EditOp::Type::SetTriggerRange, id);
+                op.a = to.get_first_note();
+                op.b = to.get_last_note();
+                out.push_back(op);
+            }
+            if (from.get_speed() != to.get_speed()) {
+                auto op = make_op(EditOp::Type::SetSpeed, id);
+                op.speed = to.get_speed();
+                out.push_back(op);
+            }
+            if (from.get_default_velocity() != to.get_default_velocity()) {
+                auto op = make_op(EditOp::Type::SetDefaultVelocity, id);
+                op.a = to.get_default_velocity();
+                out.push_back(op);
+            }
+            if (from.cursor != to.cursor) {
+                out.push_back(make_cell_op(EditOp::Type::SetCursor, id, to.cursor));
+            }
+            if (from.get_viewport() != to.get_viewport()) {
+                auto op = make_op(EditOp::Type::SetViewport, id);
+                op.viewport_x = to.get_viewport().x;
+                op.viewport_y = to.get_viewport().y;
+                out.push_back(op);
+            }
+
+            // Cells go in three passes so that no op lands on a cell that is about to change:
+            // removed notes first, then shortened ones, then new and changed ones.
+            // Since `to` has no overlapping notes, nothing that remains is in the way after that.
+            each_from_cell([&](const Cell &c) {
+                if (!cell_starting_at(to, c.position).has_value()) {
+                    out.push_back(make_cell_op(EditOp::Type::ClearCell, id, c.position));
+                }
+            });
+            each_from_cell([&](const Cell &c) {
+                const auto t = cell_starting_at(to, c.position);
+                if (t.has_value() && t->length < c.length) {
+                    auto op = make_cell_op(EditOp::Type::SetLength, id, c.position);
+                    op.a = t->length;
+                    out.push_back(op);
+                }
+            });
+            to.each_cell([&](const Cell &t) {
+                const auto c = from_cell(t.position);
+                if (!c.has_value() || c->velocity != t.velocity) {
+                    auto op = make_cell_op(EditOp::Type::SetCell, id, t.position);
+                    op.a = t.velocity;
+                    op.b = t.length;
+                    out.push_back(op);
+                } else if (c->length < t.length) {
+                    auto op = make_cell_op(EditOp::Type::SetLength, id, t.position);
+                    op.a = t.length;
+                    out.push_back(op);
+                }
+            });
+
+            // a lane has at most one event per offset, so lane ops never get in each other's way
+            const auto lane_end = to.lane_ticks();
+            from.each_lane_event([&](int row, const LaneEvent &e) {
+                if (e.offset < lane_end && !to.get_lane_event(row, e.offset).has_value()) {
+                    out.push_back(make_cell_op(EditOp::Type::ClearLaneEvent, id, V2i(e.offset, row)));
+                }
+            });
+            to.each_lane_event([&](int row, const LaneEvent &e) {
+                const auto f = from.get_lane_event(row, e.offset);
+                if (!f.has_value() || f->velocity != e.velocity || f->length != e.length) {
+                    auto op = make_cell_op(EditOp::Type::SetLaneEvent, id, V2i(e.offset, row));
+                    op.a = e.velocity;
+                    op.b = e.length;
+                    out.push_back(op);
+                }
+            });
+        }
+    }
+
+    void diff_states(const State &from, const State &to, std::vector<EditOp> &out) {
+        for (const auto &p: from.patterns) {
+            if (!to.has_pattern(p->id)) {
+                out.push_back(make_op(EditOp::Type::DeletePattern, p->id));
+            }
+        }
+        for (std::size_t i = 0; i < to.patterns.size(); i++) {
+            const auto &p = *to.patterns[i];
+            const auto old_pattern = from.find_pattern(p.id);
+            if (old_pattern != nullptr) {
+                // an unchanged pattern costs a hash comparison, so the ops cost what changed
+                if (old_pattern->content_hash() != p.content_hash()) {
+                    diff_patterns(*old_pattern, p, out);
+                }
+            } else {
+                auto op = make_op(EditOp::Type::CreatePattern, p.id);
+                op.a = (int) i;
+                out.push_back(op);
+                diff_patterns(Pattern(p.id), p, out);
+            }
+        }
+        if (from.get_selected_id() != to.get_selected_id() || from.play_selected != to.play_selected
+            || from.play_note_triggered != to.play_note_triggered) {
+            auto op = make_op(EditOp::Type::SetPlayback, to.get_selected_id());
+            op.a = to.play_selected;
+            op.b = to.play_note_triggered;
+            out.push_back(op);
+        }
+    }
+
+    static void apply_pattern_edit(State &state, Pattern *p, const EditOp &op) {
+        const V2i position(op.x, op.y);
+        switch (op.type) {
+            case EditOp::Type::SetCell:
+                p->set_velocity(position, (uint8_t) op.a);
+                p->set_length(position, op.b);
+                break;
+            case EditOp::Type::ClearCell:
+                p->clear_cell(position);
+                break;
+            case EditOp::Type::SetLength:
+                p->set_length(position, op.a);
+                break;
+            case EditOp::Type::SetSpeed:
+                p->set_speed(op.speed);
+                break;
+            case EditOp::Type::Resize:
+                p->resize_width(op.a);
+                state.rebuild_trigger_table();
+                break;
+            case EditOp::Type::SetTriggerRange:
+                p->set_note_trigger_range(op.a, op.b - op.a + 1);
+                state.rebuild_trigger_table();
+                break;
+            case EditOp::Type::SetDefaultVelocity:
+                p->set_default_velocity((uint8_t) op.a);
+                break;
+            case EditOp::Type::SetCursor:
+                p->cursor = position;
+                break;
+            case EditOp::Type::SetViewport:
+                p->set_viewport(V2f(op.viewport_x, op.viewport_y));
+                break;
+            case EditOp::Type::SetLaneEvent:
+                p->set_lane_event(op.y, {op.x, (uint8_t) op.a, op.b});
+                break;
+            case EditOp::Type::ClearLaneEvent:
+                p->clear_lane_event(op.y, op.x);
+                break;
+            default:
+                assert(false);
+        }
+    }
+
+    void apply_edit(State &state, const EditOp &op) {
+        switch (op.type) {
+            case EditOp::Type::CreatePattern:
+                if (!state.has_pattern(op.pattern_id)) {
+                    state.add_pattern(Pattern(op.pattern_id), (std::size_t) op.a);
+                }
+                return;
+            case EditOp::Type::DeletePattern: {
+                // delete_pattern() moves the selection, the sender says where it goes with SetPlayback
+                const auto selected = state.get_selected_id();
+                state.delete_pattern(op.pattern_id);
+                state.set_selected_id(selected);
+                return;
+            }
+            case EditOp::Type::SetPlayback:
+                state.set_selected_id(op.pattern_id);
+                state.play_selected = op.a != 0;
+                state.play_note_triggered = op.b != 0;
+                return;
+            default:
+                break;
+        }
+
+        auto p = state.find_pattern(op.pattern_id);
+        if (p != nullptr) {
+            apply_pattern_edit(state, p, op);
+        }
+    }
+
+    bool apply_edit_in_place(State &state, const EditOp &op) {
+        assert(!op.needs_snapshot());
+        if (op.type == EditOp::Type::SetPlayback) {
+            apply_edit(state, op);
+            return true;
+        }
+        auto p = state.find_pattern_in_place(op.pattern_id);
+        if (p == nullptr) {
+            return !state.has_pattern(op.pattern_id);
+        }
+        apply_pattern_edit(state, p, op);
+        return true;
+    }
+
+    static void assert_same_state(const State &a, const State &b) {
+        assert(a.num_patterns() == b.num_patterns());
+        assert(a.get_selected_id() == b.get_selected_id());
+        assert(a.play_selected == b.play_selected);
+        assert(a.play_note_triggered == b.play_note_triggered);
+        for (std::size_t i = 0; i < a.num_patterns(); i++) {
+            assert(a.patterns[i]->id == b.patterns[i]->id);
+        }
+        assert(a.content_hash() == b.content_hash());
+        for (const auto &cow: a.patterns) {
+            const auto pa = cow->decoded();
+            const auto pb = b.get_pattern(pa.id).decoded();
+            assert(pa.width == pb.width);
+            assert(pa.get_first_note() == pb.get_first_note() && pa.get_last_note() == pb.get_last_note());
+            assert(pa.get_speed() == pb.get_speed());
+            assert(pa.get_default_velocity() == pb.get_default_velocity());
+            assert(pa.cursor == pb.cursor);
+            assert(pa.content_hash() == pb.content_hash());
+            int count = 0;
+            pa.each_cell([&](const Cell &c) {
+                const auto other = cell_starting_at(pb, c.position);
+                assert(other.has_value());
+                assert(other->velocity == c.velocity && other->length == c.length);
+                count++;
+            });
+            pb.each_cell([&](const Cell &) {
+                count--;
+            });
+            assert(count == 0);
+            pa.each_lane_event([&](int row, const LaneEvent &e) {
+                const auto other = pb.get_lane_event(row, e.offset);
+                assert(other.has_value() && other->velocity == e.velocity && other->length == e.length);
+                count++;
+            });
+            pb.each_lane_event([&](int, const LaneEvent &) {
+                count--;
+            });
+            assert(count == 0);
+        }
+    }
+
+    // Edits a state the way the UI does, then checks that replaying the diff on a copy of the
+    // original ends up with the same state
+    void test_edits() {
+        std::mt19937 rng(1234);
+        auto rand_int = [&](int lo, int hi) {
+            return std::uniform_int_distribution<int>(lo, hi)(rng);
+        };
+        State state;
+        state.create_pattern();
+        state.set_selected_id(0);
+        for (int round = 0; round < 200; round++) {
+            // now and then with every pattern still encoded, the way a state is after loading
+            if (round % 10 == 9) {
+                state = State::from_binary(std::make_shared<const std::string>(state.to_binary()));
+            }
+            const auto before = state;
+            for (int i = 0; i < rand_int(1, 8); i++) {
+                auto &p = state.get_pattern(state.patterns[rand_int(0, (int) state.num_patterns() - 1)]->id);
+                const V2i v(rand_int(0, p.width - 1), rand_int(120, 127));
+                switch (rand_int(0, 13)) {
+                    case 0:
+                    case 1:
+                    case 2:
+                        p.set_velocity(v, (uint8_t) rand_int(1, 127));
+                        break;
+                    case 3:
+                        p.clear_cell(v);
+                        break;
+                    case 4:
+                        if (p.exists(v)) {
+                            const auto c = p.get_cell(v);
+                            p.set_length(c.position, rand_int(1, p.width - c.position.x));
+                        }
+                        break;
+                    case 5: {
+                        Selection selection;
+                        p.set_selected(selection, v, true);
+                        p.move_selected_cells(selection, V2i(0, rand_int(-1, 1)));
+                        break;
+                    }
+                    case 6:
+                        p.resize_width(rand_int(4, 40));
+                        state.rebuild_trigger_table();
+                        break;
+                    case 7:
+                        p.set_note_trigger_range(rand_int(0, 100), rand_int(1, 16));
+                        state.rebuild_trigger_table();
+                        break;
+                    case 8:
+                        p.set_speed((float) rand_int(1, 4) * 0.5f);
+                        p.cursor = v;
+                        p.set_default_velocity((uint8_t) rand_int(1, 127));
+                        break;
+                    case 9:
+                        state.set_selected_id(state.duplicate_pattern(p.id).id);
+                        break;
+                    case 10:
+                        if (state.num_patterns() > 1) {
+                            state.delete_pattern(p.id);
+                        }
+                        break;
+                    case 11:
+                        state.play_selected = !state.play_selected;
+                        break;
+                    case 12:
+                        p.set_lane_event(v.y, {rand_int(0, p.lane_ticks() - 1) & ~63, (uint8_t) rand_int(1, 127),
+                                               rand_int(1, 2000)});
+                        break;
+                    case 13: {
+                        const auto offset = p.next_lane_offset(rand_int(0, p.lane_ticks() - 1));
+                        if (offset >= 0) {
+                            int row = -1;
+                            p.each_lane_event_between(offset, offset + 1, [&](int r, const LaneEvent &) {
+                                row = r;
+                            });
+                            p.clear_lane_event(row, offset);
+                        }
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            }
+            std::vector<EditOp> ops;
+            diff_states(before, state, ops);
+            auto replayed = before;
+            for (const auto &op: ops) {
+                apply_edit(replayed, op);
+            }
+            assert_same_state(state, replayed);
+
+            ops.clear();
+            diff_states(state, replayed, ops);
+            assert(ops.empty());
+
+            // and backwards, the way undo uses it
+            diff_states(state, before, ops);
+            auto undone = state;
+            for (const auto &op: ops) {
+                apply_edit(undone, op);
+            }
+            assert_same_state(before, undone);
+        }
+
+        // the audio thread leaves ops for patterns it has encoded or shared to the next snapshot
+        auto rt = State::from_binary(std::make_shared<const std::string>(state.to_binary()));
+        auto op = make_cell_op(EditOp::Type::SetCell, rt.patterns[0]->id, V2i(0, 0));
+        op.a = 99;
+        op.b = 1;
+        assert(!apply_edit_in_place(rt, op) && !rt.patterns[0]->is_decoded());
+        rt.decode_all();
+        const auto shared = rt;
+        assert(!apply_edit_in_place(rt, op) && rt.patterns[0].shares_with(shared.patterns[0]));
+        rt.prepare_for_realtime(1);
+        assert(apply_edit_in_place(rt, op) && std::as_const(rt).get_pattern(op.pattern_id).get_velocity(V2i(0, 0)) == 99);
+    }
+}
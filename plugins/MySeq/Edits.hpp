@@ -0,0 +1,81 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_EDITS_HPP
+#define MY_PLUGINS_EDITS_HPP
+
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "Patterns.hpp"
+
+namespace myseq {
+
+    void test_edits();
+
+    // A single change to a State, small and trivially copyable so that it can go through a ring buffer.
+    // seq numbers the ops that affect playback, assigned by the DSP side in the order it applies them.
+    struct EditOp {
+        enum class Type : uint8_t {
+            // applied by the audio thread as they arrive
+            SetCell,        // x, y, a = velocity, b = length
+            ClearCell,      // x, y
+            SetLength,      // x, y, a = length
+            SetSpeed,       // speed
+            SetPlayback,    // pattern_id = selected pattern, a = play_selected, b = play_note_triggered
+            // change the pattern list or the trigger table, the audio thread gets these through a new snapshot
+            Resize,         // a = width
+            SetTriggerRange,// a = first note, b = last note
+            CreatePattern,  // a = index in the pattern list
+            DeletePattern,
+            // no effect on playback, only kept so that getState() returns what the UI shows
+            SetDefaultVelocity, // a = velocity
+            SetCursor,      // x, y
+            SetViewport,    // viewport_x, viewport_y
+            // lane events, applied by the audio thread as they arrive. Kept last so that the
+            // numbers of the other types in saved undo logs stay the same
+            SetLaneEvent,   // y = row, x = offset, a = velocity, b = length
+            ClearLaneEvent, // y = row, x = offset
+        };
+        Type type;
+        bool flag; // unused since the selection left the state, kept for the undo log format
+        uint64_t seq;
+        int pattern_id;
+        int x;
+        int y;
+        int a;
+        int b;
+        float speed;
+        // plain floats rather than V2f, whose constructors would make the op non-trivial
+        float viewport_x;
+        float viewport_y;
+
+        [[nodiscard]] bool affects_playback() const {
+            return type < Type::SetDefaultVelocity || type >= Type::SetLaneEvent;
+        }
+
+        [[nodiscard]] bool needs_snapshot() const {
+            return type >= Type::Resize && type <= Type::DeletePattern;
+        }
+    };
+
+    // HeapRingBuffer copies ops with memcpy
+    static_assert(std::is_trivially_copyable_v<EditOp> && std::is_trivial_v<EditOp>);
+
+    // Appends ops that turn `from` into `to`; patterns are matched by id.
+    // Applying them in order with apply_edit() makes from equal to to, except for
+    // the ImGui settings string
+    void diff_states(const State &from, const State &to, std::vector<EditOp> &out);
+
+    // Ops for patterns that do not exist are ignored. May decode and copy the pattern,
+    // the audio thread uses apply_edit_in_place()
+    void apply_edit(State &state, const EditOp &op);
+
+    // For the audio thread: applies an op that does not need a snapshot without decoding or copying
+    // anything, as long as the pattern has room for new cells (see State::prepare_for_realtime).
+    // Returns false and leaves state alone when the pattern is still encoded or shared with another State
+    bool apply_edit_in_place(State &state, const EditOp &op);
+}
+
+#endif //MY_PLUGINS_EDITS_HPP
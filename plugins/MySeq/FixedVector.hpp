@@ -0,0 +1,119 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_FIXEDVECTOR_HPP
+#define MY_PLUGINS_FIXEDVECTOR_HPP
+
+#include <array>
+#include <cstddef>
+#include "MyAssert.hpp"
+
+// Vector with inline storage of N elements; never allocates,
+// so it can be used from the audio thread.
+// push_back() on a full vector drops the element and returns false.
+template<typename T, std::size_t N>
+struct FixedVector {
+    std::array<T, N> data{};
+    std::size_t count = 0;
+
+    using iterator = typename std::array<T, N>::iterator;
+    using const_iterator = typename std::array<T, N>::const_iterator;
+
+    [[nodiscard]] static constexpr std::size_t capacity() {
+        return N;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return count;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return count == 0;
+    }
+
+    [[nodiscard]] bool full() const {
+        return count == N;
+    }
+
+    void clear() {
+        count = 0;
+    }
+
+    bool push_back(const T &x) {
+        if (full()) {
+            return false;
+        }
+        data[count++] = x;
+        return true;
+    }
+
+    // Shifts the tail right by one; keeps the vector ordered when used with lower_bound
+    bool insert(iterator pos, const T &x) {
+        if (full()) {
+            return false;
+        }
+        const auto index = pos - begin();
+        for (auto i = (std::ptrdiff_t) count; i > index; i--) {
+            data[i] = data[i - 1];
+        }
+        data[index] = x;
+        count++;
+        return true;
+    }
+
+    iterator erase(iterator pos) {
+        assert(pos >= begin() && pos < end());
+        for (auto it = pos; it + 1 != end(); ++it) {
+            *it = *(it + 1);
+        }
+        count--;
+        return pos;
+    }
+
+    // Visits every element once, in order, and removes those for which f returns true.
+    // Order of remaining elements is preserved.
+    template<typename F>
+    std::size_t erase_if(F f) {
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            if (!f(data[i])) {
+                if (kept != i) {
+                    data[kept] = data[i];
+                }
+                kept++;
+            }
+        }
+        const auto removed = count - kept;
+        count = kept;
+        return removed;
+    }
+
+    T &operator[](std::size_t i) {
+        assert(i < count);
+        return data[i];
+    }
+
+    const T &operator[](std::size_t i) const {
+        assert(i < count);
+        return data[i];
+    }
+
+    iterator begin() {
+        return data.begin();
+    }
+
+    iterator end() {
+        return data.begin() + count;
+    }
+
+    const_iterator begin() const {
+        return data.begin();
+    }
+
+    const_iterator end() const {
+        return data.begin() + count;
+    }
+};
+
+#endif //MY_PLUGINS_FIXEDVECTOR_HPP
@@ -158,6 +158,50 @@ void gen_array_test_basic() {
 
 }
 
+void gen_array_test_compact() {
+    std::srand(1);
+    GenArray<int> arr;
+    std::vector<Id> ids;
+    const int count = 1000;
+    for (int i = 0; i < count; i++) {
+        ids.push_back(arr.push(i));
+    }
+    // bump some generations, then leave holes
+    for (int i = 0; i < count; i += 7) {
+        arr.remove(ids[i]);
+        ids[i] = arr.push(i);
+    }
+    std::vector<Id> remaining;
+    for (int i = 0; i < count; i++) {
+        if (std::rand() % 3 == 0) {
+            arr.remove(ids[i]);
+        } else {
+            remaining.push_back(ids[i]);
+        }
+    }
+    const auto remap = arr.compact();
+    assert(arr.size() == remaining.size());
+    assert(arr.data.size() == remaining.size() && arr.free.empty());
+    int previous = -1;
+    for (std::size_t i = 0; i < remaining.size(); i++) {
+        const auto old_id = remaining[i];
+        const auto new_id = remap[old_id.index];
+        assert(new_id.index == (int) i && new_id.gen == old_id.gen);
+        assert(arr.get(new_id) > previous);
+        previous = arr.get(new_id);
+    }
+    int n = 0;
+    for (const auto x: arr) {
+        assert(x == arr.get(remap[remaining[n++].index]));
+    }
+    assert(n == (int) remaining.size());
+    for (const auto &id: remap) {
+        assert(id.is_null() || arr.exists(id));
+    }
+    const auto pushed = arr.push(-1);
+    assert(pushed.index == (int) remaining.size() && arr.get(pushed) == -1);
+    assert(arr.size() == remaining.size() + 1);
+}
 
 void gen_array_tests() {
     gen_array_test_more_elements();
@@ -165,5 +209,6 @@ void gen_array_tests() {
     gen_array_test_rand();
     gen_array_test_mutate();
     gen_array_test_const_iterator();
+    gen_array_test_compact();
 }
 
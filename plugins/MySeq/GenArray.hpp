@@ -4,6 +4,7 @@
 #ifndef MY_PLUGINS_GENARRAY_HPP
 #define MY_PLUGINS_GENARRAY_HPP
 
+#include <cstdint>
 #include <vector>
 #include <optional>
 #include <set>
@@ -31,11 +32,37 @@ struct Id {
     }
 };
 
+// Slots are tracked by an occupancy bitmap, so iterating costs O(words + live elements)
+// no matter how many holes removals left. Free slots hold default constructed T.
 template<typename T>
 struct GenArray {
-    std::vector<std::optional<T>> data;
+    std::vector<T> data;
     std::vector<int> data_gen;
     std::vector<int> free;
+    // bit i % 64 of occupied[i / 64] is set when data[i] is live
+    std::vector<uint64_t> occupied;
+    std::size_t live = 0;
+
+    [[nodiscard]] bool is_occupied(int index) const {
+        return (occupied[index >> 6] >> (index & 63)) & 1;
+    }
+
+    // First live index at or after index, data.size() if there is none
+    [[nodiscard]] int next_occupied(int index) const {
+        const auto n = (int) data.size();
+        if (index >= n) {
+            return n;
+        }
+        auto w = index >> 6;
+        auto word = occupied[w] & (~uint64_t(0) << (index & 63));
+        while (word == 0) {
+            if (++w >= (int) occupied.size()) {
+                return n;
+            }
+            word = occupied[w];
+        }
+        return std::min(n, w * 64 + __builtin_ctzll(word));
+    }
 
     //GenArray() = default;
 
@@ -50,9 +77,7 @@ struct GenArray {
         int index;
 
         void seek_valid() {
-            while (index < (int) ga->data.size() && !ga->data[index].has_value()) {
-                index++;
-            }
+            index = ga->next_occupied(index);
         }
 
     public:
@@ -81,7 +106,7 @@ struct GenArray {
         }
 
         const T &operator*() const {
-            return ga->data[index].value();
+            return ga->data[index];
         }
 
         using difference_type = int;
@@ -97,9 +122,7 @@ struct GenArray {
         int index;
 
         void seek_valid() {
-            while (index < (int) ga->data.size() && !ga->data[index].has_value()) {
-                index++;
-            }
+            index = ga->next_occupied(index);
         }
 
     public:
@@ -131,7 +154,7 @@ struct GenArray {
         }
 
         T &operator*() {
-            return *(ga->data[index]);
+            return ga->data[index];
         }
 
         using difference_type = int;
@@ -148,7 +171,7 @@ struct GenArray {
     }
 
     void verify_index(const int index) const {
-        if (index >= (int) data.size() || index < 0 || !data[index].has_value()) {
+        if (index >= (int) data.size() || index < 0 || !is_occupied(index)) {
             throw std::runtime_error("verify_index: does not exist");
         }
     }
@@ -170,19 +193,15 @@ struct GenArray {
     }
 
     [[nodiscard]] std::size_t size() const {
-        const auto ret = data.size() - free.size();
 #ifdef DEBUG
-        const auto actual = std::count_if(data.begin(), data.end(), [](const std::optional<T> &x) {
-            return x.has_value();
-        });
-        assert((int)ret == actual);
+        assert(live == data.size() - free.size());
 #endif // DEBUG
-        return ret;
+        return live;
     }
 
     [[nodiscard]] bool exists(const Id &id) const {
         return id.index >= 0 && id.index < (int) data.size()
-               && data[id.index].has_value()
+               && is_occupied(id.index)
                && data_gen[id.index] == id.gen;
     }
 
@@ -199,8 +218,10 @@ struct GenArray {
 
     void remove_at_index(int index) {
         verify_index(index);
-        data[index].reset();
+        data[index] = T();
+        occupied[index >> 6] &= ~(uint64_t(1) << (index & 63));
         free.push_back(index);
+        live--;
     }
 
     iterator erase(const iterator &it) {
@@ -219,29 +240,60 @@ struct GenArray {
         return it;
     }
 
+    // Moves the live elements to the front, keeping their order and generations, and drops the free slots.
+    // Returns the new id for every old index, Id::null() for the ones that were free.
+    // Ids from before do not stay valid, they need to be translated with the remap
+    std::vector<Id> compact() {
+        std::vector<Id> remap(data.size());
+        int next = 0;
+        for (int i = next_occupied(0); i < (int) data.size(); i = next_occupied(i + 1)) {
+            if (i != next) {
+                data[next] = std::move(data[i]);
+                data_gen[next] = data_gen[i];
+            }
+            remap[i] = {next, data_gen[next]};
+            next++;
+        }
+        data.erase(data.begin() + next, data.end());
+        data_gen.erase(data_gen.begin() + next, data_gen.end());
+        free.clear();
+        occupied.assign((next + 63) / 64, ~uint64_t(0));
+        if (next % 64 != 0) {
+            occupied.back() = (uint64_t(1) << (next % 64)) - 1;
+        }
+        return remap;
+    }
+
     Id push(T x) {
+        live++;
         if (!free.empty()) {
             int index = free.back();
             int gen = data_gen[index] + 1;
             free.pop_back();
-            data[index] = x;
+            data[index] = std::move(x);
             data_gen[index] = gen;
+            occupied[index >> 6] |= uint64_t(1) << (index & 63);
             return {index, gen};
         } else {
-            data.push_back({x});
+            const auto index = static_cast<int>(data.size());
+            data.push_back(std::move(x));
             data_gen.push_back(0);
-            return {static_cast<int>(data.size()) - 1, 0};
+            if (index % 64 == 0) {
+                occupied.push_back(0);
+            }
+            occupied[index >> 6] |= uint64_t(1) << (index & 63);
+            return {index, 0};
         }
     }
 
     T &get(const Id &id) {
         verify_id(id);
-        return data[id.index].value();
+        return data[id.index];
     }
 
     const T &get(const Id &id) const {
         verify_id(id);
-        return data[id.index].value();
+        return data[id.index];
     }
 
     T &operator[](const Id &id) {
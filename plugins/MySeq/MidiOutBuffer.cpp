@@ -0,0 +1,118 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#include <algorithm>
+#include <vector>
+#include "DistrhoUtils.hpp"
+#include "MidiOutBuffer.hpp"
+
+namespace myseq {
+
+    void MidiOutBuffer::push(uint32_t frame, uint8_t note, uint8_t velocity) {
+        assert(note <= 127);
+        const auto order = static_cast<uint32_t>(events.size());
+        if (!events.push_back({frame, order, note, velocity})) {
+            d_debug("MidiOutBuffer: too many events in block, dropping %d %d", note, velocity);
+        }
+    }
+
+    void MidiOutBuffer::finish_block() {
+        const auto first = events.begin() + static_cast<std::ptrdiff_t>(carried);
+        std::sort(first, events.end(), [](const MidiOutEvent &a, const MidiOutEvent &b) {
+            if (a.frame != b.frame) return a.frame < b.frame;
+            if (a.note != b.note) return a.note < b.note;
+            return a.order < b.order;
+        });
+
+        // Reduce each (frame, note) group to at most an off and an on. Groups that
+        // produce two events have at least two, so out never overtakes the group being read
+        auto out = first;
+        for (auto it = first; it != events.end();) {
+            const auto group = *it;
+            bool any_off = false;
+            bool ends_on = false;
+            uint8_t on_velocity = 0;
+            for (; it != events.end() && it->frame == group.frame && it->note == group.note; ++it) {
+                ends_on = it->velocity > 0;
+                if (ends_on) {
+                    on_velocity = it->velocity;
+                } else {
+                    any_off = true;
+                }
+            }
+            if (any_off && sounding[group.note]) {
+                *out++ = {group.frame, group.order, group.note, 0};
+            }
+            if (ends_on) {
+                *out++ = {group.frame, group.order, group.note, on_velocity};
+            }
+            sounding[group.note] = ends_on;
+        }
+        events.count = static_cast<std::size_t>(out - events.begin());
+
+        std::sort(first, events.end(), [](const MidiOutEvent &a, const MidiOutEvent &b) {
+            if (a.frame != b.frame) return a.frame < b.frame;
+            if ((a.velocity > 0) != (b.velocity > 0)) return a.velocity == 0;
+            return a.note < b.note;
+        });
+    }
+
+    void test_midi_out_buffer() {
+        MidiOutBuffer b;
+        std::vector<MidiOutEvent> written;
+        auto write_all = [&](const MidiOutEvent &e) {
+            written.push_back(e);
+            return true;
+        };
+
+        // unsorted input comes out by frame, offs first
+        b.push(10, 60, 100);
+        b.push(5, 62, 100);
+        b.push(10, 62, 0);
+        b.finish_block();
+        b.write(write_all);
+        assert(written.size() == 3);
+        assert(written[0].frame == 5 && written[0].note == 62 && written[0].velocity == 100);
+        assert(written[1].frame == 10 && written[1].note == 62 && written[1].velocity == 0);
+        assert(written[2].frame == 10 && written[2].note == 60 && written[2].velocity == 100);
+        assert(b.sounding[60] && !b.sounding[62]);
+
+        // retrigger keeps off then on, zero length note and off for a silent key are dropped
+        written.clear();
+        b.push(3, 60, 0);
+        b.push(3, 60, 90);
+        b.push(4, 64, 100);
+        b.push(4, 64, 0);
+        b.push(4, 65, 0);
+        b.finish_block();
+        b.write(write_all);
+        assert(written.size() == 2);
+        assert(written[0].note == 60 && written[0].velocity == 0);
+        assert(written[1].note == 60 && written[1].velocity == 90);
+        assert(b.sounding[60] && !b.sounding[64]);
+
+        // events that do not fit go out first in the next block
+        written.clear();
+        b.push(7, 60, 0);
+        b.push(1, 61, 100);
+        b.finish_block();
+        b.write([&](const MidiOutEvent &e) {
+            if (!written.empty()) {
+                return false;
+            }
+            written.push_back(e);
+            return true;
+        });
+        assert(written.size() == 1 && written[0].note == 61);
+        assert(b.carried == 1 && b.events[0].frame == 0 && b.events[0].note == 60);
+        written.clear();
+        b.push(0, 61, 0);
+        b.finish_block();
+        b.write(write_all);
+        assert(written.size() == 2);
+        assert(written[0].note == 60 && written[0].velocity == 0);
+        assert(written[1].note == 61 && written[1].velocity == 0);
+        assert(b.carried == 0 && b.events.empty());
+    }
+}
@@ -0,0 +1,79 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_MIDIOUTBUFFER_HPP
+#define MY_PLUGINS_MIDIOUTBUFFER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include "FixedVector.hpp"
+
+namespace myseq {
+
+    void test_midi_out_buffer();
+
+    // Notes beyond this in one block are dropped
+    static constexpr std::size_t MAX_BLOCK_EVENTS = 4096;
+
+    // Frame within a block of a time relative to the block start, in ticks.
+    // Notes that were due before the block go out at its start
+    inline uint32_t block_frame(double time, double frames_per_tick, uint32_t frames) {
+        const auto last_frame = frames > 0 ? frames - 1 : 0;
+        return time > 0.0 ? static_cast<uint32_t>(std::min(static_cast<double>(last_frame), time * frames_per_tick)) : 0;
+    }
+
+    struct MidiOutEvent {
+        uint32_t frame;
+        // position in the order the player produced the events
+        uint32_t order;
+        uint8_t note;
+        // 0 for note off
+        uint8_t velocity;
+    };
+
+    // Collects the notes the player produces during a block, in whatever order, and hands
+    // them to the host sorted by frame with note offs ahead of note ons at the same frame.
+    //
+    // Per frame and key, events are reduced to what the receiver needs to hear: a note off only
+    // if the key is sounding, and a note on if the key ends up sounding. A note that starts and
+    // ends on the same frame is dropped instead of turning into a stuck note by the reordering.
+    struct MidiOutBuffer {
+        FixedVector<MidiOutEvent, MAX_BLOCK_EVENTS> events;
+        // events[0] .. events[carried - 1] did not fit into the previous block and are final already
+        std::size_t carried = 0;
+        // note state the receiver ends up with once all events are written
+        std::array<bool, 128> sounding{};
+
+        void push(uint32_t frame, uint8_t note, uint8_t velocity);
+
+        // Sorts and reduces the events pushed since the last write()
+        void finish_block();
+
+        // Writes events until write_event returns false, the rest are written at frame 0 of the next block
+        template<typename F>
+        void write(F write_event) {
+            std::size_t written = 0;
+            while (written < events.size() && write_event(events[written])) {
+                written++;
+            }
+            std::size_t i = 0;
+            events.erase_if([&](const MidiOutEvent &) {
+                return i++ < written;
+            });
+            for (auto &e: events) {
+                e.frame = 0;
+            }
+            carried = events.size();
+        }
+
+        void clear() {
+            events.clear();
+            carried = 0;
+            sounding.fill(false);
+        }
+    };
+}
+
+#endif //MY_PLUGINS_MIDIOUTBUFFER_HPP
@@ -0,0 +1,121 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_PATTERNDECODER_HPP
+#define MY_PLUGINS_PATTERNDECODER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Patterns.hpp"
+
+namespace myseq {
+
+    // Decodes the patterns a State was loaded with on a thread of its own, so that loading only
+    // reads pattern headers (see State::from_binary()) and the rest is decoded after startup.
+    //
+    // The thread works on its own copies of the patterns' Cows. The owner of the State takes the decoded
+    // patterns in with adopt(), which leaves alone the patterns it has decoded or replaced meanwhile
+    class PatternDecoder {
+    public:
+        // How often on_decoded is called while patterns are being decoded
+        static constexpr std::chrono::milliseconds NOTIFY_INTERVAL{20};
+
+    private:
+        std::thread thread;
+        std::atomic<bool> cancelled{false};
+        std::mutex mutex;
+        // encoded pattern, decoded pattern; guarded by mutex
+        std::vector<std::pair<Cow<Pattern>, Cow<Pattern>>> decoded;
+
+    public:
+        PatternDecoder() = default;
+
+        ~PatternDecoder() {
+            cancel();
+        }
+
+        PatternDecoder(const PatternDecoder &) = delete;
+
+        PatternDecoder &operator=(const PatternDecoder &) = delete;
+
+        // Starts decoding the patterns of state that are still encoded, the selected one first, after
+        // cancelling an earlier start. on_decoded is called from the decoder thread when there is
+        // something to adopt, with whether that is the last of it, so do not call start() or cancel()
+        // holding a lock that on_decoded takes
+        void start(const State &state, std::function<void(bool finished)> on_decoded = {}) {
+            cancel();
+            std::vector<Cow<Pattern>> encoded;
+            for (const auto &p: state.patterns) {
+                if (!p->is_decoded()) {
+                    encoded.push_back(p);
+                }
+            }
+            std::stable_partition(encoded.begin(), encoded.end(), [&](const Cow<Pattern> &p) {
+                return p->id == state.get_selected_id();
+            });
+            if (encoded.empty()) {
+                return;
+            }
+            thread = std::thread([this, encoded = std::move(encoded), on_decoded = std::move(on_decoded)]() {
+                auto notified = std::chrono::steady_clock::now();
+                for (std::size_t i = 0; i < encoded.size() && !cancelled.load(std::memory_order_relaxed); i++) {
+                    Cow<Pattern> pattern(encoded[i]->decoded());
+                    {
+                        const std::lock_guard<std::mutex> lock(mutex);
+                        decoded.emplace_back(encoded[i], std::move(pattern));
+                    }
+                    const auto now = std::chrono::steady_clock::now();
+                    const auto finished = i + 1 == encoded.size();
+                    if (on_decoded && (finished || now - notified >= NOTIFY_INTERVAL)) {
+                        on_decoded(finished);
+                        notified = now;
+                    }
+                }
+            });
+        }
+
+        // Stops the thread and drops what it decoded and was not adopted yet
+        void cancel() {
+            cancelled = true;
+            wait();
+            cancelled = false;
+            const std::lock_guard<std::mutex> lock(mutex);
+            decoded.clear();
+        }
+
+        // Waits until everything is decoded
+        void wait() {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+
+        // Puts the patterns decoded so far into state and their ids into adopted_ids, when given.
+        // Returns whether any of them went in
+        bool adopt(State &state, std::vector<int> *adopted_ids = nullptr) {
+            std::vector<std::pair<Cow<Pattern>, Cow<Pattern>>> ready;
+            {
+                const std::lock_guard<std::mutex> lock(mutex);
+                ready.swap(decoded);
+            }
+            bool adopted = false;
+            for (auto &[encoded, pattern]: ready) {
+                const auto id = encoded->id;
+                if (state.adopt_decoded(encoded, std::move(pattern))) {
+                    adopted = true;
+                    if (adopted_ids != nullptr) {
+                        adopted_ids->push_back(id);
+                    }
+                }
+            }
+            return adopted;
+        }
+    };
+}
+
+#endif //MY_PLUGINS_PATTERNDECODER_HPP
@@ -2,80 +2,295 @@
 // Created by Arunas on 23/05/2024.
 //
 
-#include "rapidjson/document.h"
+#include "rapidjson/reader.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/error/en.h"
-#include "rapidjson/stringbuffer.h"
+#include "rapidjson/filewritestream.h"
+
+#include <cctype>
 
 #include "Patterns.hpp"
+#include "PatternDecoder.hpp"
 
 namespace myseq {
 
-    [[nodiscard]] V2f v2f_from_json(const rapidjson::Value &value) {
-        return {value["x"].GetFloat(), value["y"].GetFloat()};
-    }
-
-    [[nodiscard]] rapidjson::Value
-    v2f_to_json(const V2f &v, rapidjson::Document::AllocatorType &allocator) {
-        rapidjson::Value pobj(rapidjson::kObjectType);
-        pobj.AddMember("x", v.x, allocator)
-                .AddMember("y", v.y, allocator);
-        return pobj;
-    }
-
-    Pattern pattern_from_json(const rapidjson::Value &value) {
-        auto id = value["id"].GetInt();
-        auto width = value["width"].GetInt();
-        auto height = value["height"].GetInt();
-        auto first_note = value["first_note"].GetInt();
-        auto last_note = value["last_note"].GetInt();
-        auto default_velocity = value.HasMember("default_velocity") ? value["default_velocity"].GetInt() : 127;
-        auto speed = value.HasMember("speed") ? value["speed"].GetFloat() : 1.0;
-        auto carr = value["cells"].GetArray();
-        V2f viewport = value.HasMember("viewport") ?
-                       v2f_from_json(value["viewport"]) : V2f(0.0, 0.0);
-        int cursor_x = value.HasMember("cursor_x") ?
-                       value["cursor_x"].GetInt() : 0;
-        int cursor_y = value.HasMember("cursor_y") ?
-                       value["cursor_y"].GetInt() : 0;
-        Pattern p(id, width, height, first_note, last_note, V2i(cursor_x, cursor_y));
-        p.set_speed((float) speed);
-        p.set_default_velocity((uint8_t) default_velocity);
-        p.set_viewport(viewport);
-        for (int i = 0; i < (int) carr.Size(); i++) {
-            auto cobj = carr[i].GetObject();
-            int x = cobj["x"].GetInt();
-            int y = cobj["y"].GetInt();
-            const auto v = V2i(x, y);
-            auto velocity = static_cast<uint8_t>(cobj["v"].GetInt());
-            bool selected = cobj.HasMember("s") ? (cobj["s"].GetBool()) : false;
-            int length = cobj.HasMember("n") ? (cobj["n"].GetInt()) : 1;
-            p.set_velocity(v, velocity, "JSON");
-            p.set_selected(v, selected);
-            p.set_length(v, length);
-        }
-        return p;
-    }
+    // Builds the state while rapidjson's Reader goes through the JSON, there is no document.
+    // Cells and lane events of a pattern are kept until the pattern ends, as its size may come
+    // after them, and then go through a PatternBuilder. Unknown keys are skipped and missing keys
+    // get the defaults they always had
+    class JsonStateReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, JsonStateReader> {
+        enum class Where {
+            Document, Top, Patterns, Pattern, Viewport, Cells, Cell, Lanes, Lane, Skip
+        };
+
+        enum class Field {
+            Other, Selected, PlaySelected, PlayNoteTriggered, Settings, Patterns,
+            Id, Width, Height, FirstNote, LastNote, CursorX, CursorY, Speed, DefaultVelocity,
+            Viewport, ViewportX, ViewportY, Cells, Lanes, X, Y, V, N, T, Count
+        };
+
+        // Numbers of the object being read, by field
+        struct Fields {
+            std::array<double, (int) Field::Count> values{};
+            uint32_t seen = 0;
+
+            void set(Field f, double v) {
+                values[(int) f] = v;
+                seen |= 1u << (int) f;
+            }
+
+            [[nodiscard]] double get(Field f, double fallback) const {
+                return (seen & (1u << (int) f)) ? values[(int) f] : fallback;
+            }
+
+            // Exits when f is missing, for fields that are only checked for presence
+            void require(Field f, const char *name) const {
+                if (!(seen & (1u << (int) f))) {
+                    fprintf(stderr, "JSON state is missing \"%s\"\n", name);
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            [[nodiscard]] int required(Field f, const char *name) const {
+                require(f, name);
+                return (int) values[(int) f];
+            }
+        };
+
+        struct Name {
+            const char *name;
+            Field field;
+        };
+
+        static Field field_of(Where where, const char *s, rapidjson::SizeType length) {
+            static const Name top[] = {{"selected", Field::Selected}, {"play_selected", Field::PlaySelected},
+                                       {"play_note_triggered", Field::PlayNoteTriggered},
+                                       {"settings", Field::Settings}, {"patterns", Field::Patterns}};
+            static const Name pattern[] = {{"id", Field::Id}, {"width", Field::Width}, {"height", Field::Height},
+                                           {"first_note", Field::FirstNote}, {"last_note", Field::LastNote},
+                                           {"cursor_x", Field::CursorX}, {"cursor_y", Field::CursorY},
+                                           {"speed", Field::Speed}, {"default_velocity", Field::DefaultVelocity},
+                                           {"viewport", Field::Viewport}, {"cells", Field::Cells},
+                                           {"lanes", Field::Lanes}};
+            static const Name viewport[] = {{"x", Field::ViewportX}, {"y", Field::ViewportY}};
+            // older files also have the selection in "s", it is not part of the state anymore
+            static const Name item[] = {{"x", Field::X}, {"y", Field::Y}, {"v", Field::V}, {"n", Field::N},
+                                        {"t", Field::T}};
+            auto find = [&](const auto &names) {
+                for (const auto &n: names) {
+                    if (std::strlen(n.name) == length && std::memcmp(n.name, s, length) == 0) {
+                        return n.field;
+                    }
+                }
+                return Field::Other;
+            };
+            switch (where) {
+                case Where::Top:
+                    return find(top);
+                case Where::Pattern:
+                    return find(pattern);
+                case Where::Viewport:
+                    return find(viewport);
+                case Where::Cell:
+                case Where::Lane:
+                    return find(item);
+                default:
+                    return Field::Other;
+            }
+        }
+
+        std::vector<Where> stack{Where::Document};
+        Field field = Field::Other;
+        Fields top;
+        Fields pattern;
+        Fields item;
+        std::vector<Cell> cells;
+        std::vector<std::pair<int, LaneEvent>> lanes;
+
+        void push(Where where) {
+            stack.push_back(where);
+            field = Field::Other;
+        }
+
+        bool number(double v) {
+            switch (stack.back()) {
+                case Where::Top:
+                    top.set(field, v);
+                    break;
+                case Where::Pattern:
+                case Where::Viewport:
+                    pattern.set(field, v);
+                    break;
+                case Where::Cell:
+                case Where::Lane:
+                    item.set(field, v);
+                    break;
+                default:
+                    break;
+            }
+            return true;
+        }
+
+        void end_pattern() {
+            pattern.require(Field::Id, "id");
+            const auto id = pattern.get(Field::Id, 0.0);
+            if (!(id >= 0 && id < State::MAX_PATTERN_ID)) {
+                fprintf(stderr, "JSON state has a bad pattern id %g\n", id);
+                exit(EXIT_FAILURE);
+            }
+            Pattern p((int) id, pattern.required(Field::Width, "width"),
+                      pattern.required(Field::Height, "height"), pattern.required(Field::FirstNote, "first_note"),
+                      pattern.required(Field::LastNote, "last_note"),
+                      V2i((int) pattern.get(Field::CursorX, 0), (int) pattern.get(Field::CursorY, 0)));
+            pattern.require(Field::Cells, "cells");
+            p.set_speed((float) pattern.get(Field::Speed, 1.0));
+            p.set_default_velocity((uint8_t) pattern.get(Field::DefaultVelocity, 127));
+            p.set_viewport(V2f((float) pattern.get(Field::ViewportX, 0.0), (float) pattern.get(Field::ViewportY, 0.0)));
+            PatternBuilder builder(std::move(p));
+            for (const auto &c: cells) {
+                builder.add_note(c.position, c.velocity, c.length);
+            }
+            for (const auto &e: lanes) {
+                builder.add_lane_event(e.first, e.second);
+            }
+            state.patterns.emplace_back(builder.build());
+        }
+
+    public:
+        State state;
+
+        bool Null() {
+            return true;
+        }
+
+        bool Bool(bool b) {
+            if (stack.back() == Where::Top) {
+                if (field == Field::PlaySelected) {
+                    state.play_selected = b;
+                } else if (field == Field::PlayNoteTriggered) {
+                    state.play_note_triggered = b;
+                }
+            }
+            return true;
+        }
+
+        bool Int(int i) {
+            return number(i);
+        }
+
+        bool Uint(unsigned u) {
+            return number(u);
+        }
+
+        bool Int64(int64_t i) {
+            return number((double) i);
+        }
+
+        bool Uint64(uint64_t u) {
+            return number((double) u);
+        }
+
+        bool Double(double d) {
+            return number(d);
+        }
+
+        bool String(const char *s, rapidjson::SizeType length, bool) {
+            if (stack.back() == Where::Top && field == Field::Settings) {
+                state.settings.assign(s, length);
+            }
+            return true;
+        }
+
+        bool Key(const char *s, rapidjson::SizeType length, bool) {
+            field = field_of(stack.back(), s, length);
+            return true;
+        }
+
+        bool StartObject() {
+            switch (stack.back()) {
+                case Where::Document:
+                    push(Where::Top);
+                    break;
+                case Where::Patterns:
+                    pattern = Fields();
+                    cells.clear();
+                    lanes.clear();
+                    push(Where::Pattern);
+                    break;
+                case Where::Pattern:
+                    push(field == Field::Viewport ? Where::Viewport : Where::Skip);
+                    break;
+                case Where::Cells:
+                    item = Fields();
+                    push(Where::Cell);
+                    break;
+                case Where::Lanes:
+                    item = Fields();
+                    push(Where::Lane);
+                    break;
+                default:
+                    push(Where::Skip);
+                    break;
+            }
+            return true;
+        }
+
+        bool EndObject(rapidjson::SizeType) {
+            const auto where = stack.back();
+            stack.pop_back();
+            if (where == Where::Top) {
+                state.set_selected_id(top.required(Field::Selected, "selected"));
+                top.require(Field::Patterns, "patterns");
+            } else if (where == Where::Pattern) {
+                end_pattern();
+            } else if (where == Where::Cell) {
+                cells.push_back({V2i(item.required(Field::X, "x"), item.required(Field::Y, "y")),
+                                 (uint8_t) item.required(Field::V, "v"), (int) item.get(Field::N, 1)});
+            } else if (where == Where::Lane) {
+                lanes.emplace_back(item.required(Field::Y, "y"),
+                                   LaneEvent{item.required(Field::T, "t"), (uint8_t) item.required(Field::V, "v"),
+                                             (int) item.get(Field::N, 1)});
+            }
+            return true;
+        }
+
+        bool StartArray() {
+            const auto where = stack.back();
+            if (where == Where::Top && field == Field::Patterns) {
+                top.set(Field::Patterns, 0);
+                push(Where::Patterns);
+            } else if (where == Where::Pattern && field == Field::Cells) {
+                pattern.set(Field::Cells, 0);
+                push(Where::Cells);
+            } else if (where == Where::Pattern && field == Field::Lanes) {
+                push(Where::Lanes);
+            } else {
+                push(Where::Skip);
+            }
+            return true;
+        }
+
+        bool EndArray(rapidjson::SizeType) {
+            stack.pop_back();
+            return true;
+        }
+    };
 
     State State::from_json_string(const char *s) {
-        rapidjson::Document d;
-        rapidjson::ParseResult ok = d.Parse(s);
+        JsonStateReader handler;
+        rapidjson::Reader reader;
+        rapidjson::StringStream stream(s);
+        rapidjson::ParseResult ok = reader.Parse(stream, handler);
         if (!ok) {
             fprintf(stderr, "JSON parse error: %s (%lu)",
                     rapidjson::GetParseError_En(ok.Code()), ok.Offset());
             exit(EXIT_FAILURE);
         }
-        auto arr = d["patterns"].GetArray();
-        State state;
-        state.set_selected_id(d["selected"].GetInt());
-        state.play_selected = d.HasMember("play_selected") ? d["play_selected"].GetBool() : false;
-        state.settings = d.HasMember("settings") ? d["settings"].GetString() : "";
-        state.play_note_triggered = d.HasMember("play_note_triggered") ? d["play_note_triggered"].GetBool() : false;
-        for (rapidjson::SizeType i = 0; i < arr.Size(); i++) {
-            auto obj = arr[i].GetObject();
-            state.patterns.push_back(pattern_from_json(obj));
+        if (!handler.state.rebuild_index()) {
+            fprintf(stderr, "JSON state has patterns with the same id\n");
+            exit(EXIT_FAILURE);
         }
-        return state;
+        return std::move(handler.state);
     }
 
     void test_serialize() {
@@ -95,68 +310,1223 @@ namespace myseq {
         assert(state.num_patterns() == state1.num_patterns());
         assert(state.get_pattern(a.id).get_velocity(V2i(0, 1)) == state1.get_pattern(a.id).get_velocity(V2i(0, 1)));
         assert(state.get_pattern(b.id).get_velocity(V2i(2, 3)) == state1.get_pattern(b.id).get_velocity(V2i(2, 3)));
+
+        // a pattern on its own is written the same as within the state
+        std::string out = "not cleared";
+        state.write_json(out);
+        assert(out == s);
+        assert(s.find(state.get_pattern(b.id).to_json_string()) != std::string::npos);
     }
 
 
-    [[nodiscard]] rapidjson::Value
-    pattern_to_json(const Pattern &pattern, rapidjson::Document::AllocatorType &allocator) {
-        rapidjson::Value pobj(rapidjson::kObjectType);
-        pobj.AddMember("width", pattern.width, allocator)
-                .AddMember("id", pattern.id, allocator)
-                .AddMember("height", pattern.height, allocator)
-                .AddMember("first_note", pattern.get_first_note(), allocator)
-                .AddMember("last_note", pattern.get_last_note(), allocator)
-                .AddMember("cursor_x", pattern.cursor.x, allocator)
-                .AddMember("cursor_y", pattern.cursor.y, allocator)
-                .AddMember("speed", pattern.get_speed(), allocator)
-                .AddMember("default_velocity", pattern.get_default_velocity(), allocator)
-                .AddMember("viewport", v2f_to_json(pattern.get_viewport(), allocator), allocator);
-        //d.GetObject().AddMember("data", height, d.GetAllocator());
-        rapidjson::Value data_arr(rapidjson::kArrayType);
-        pattern.each_cell([&](const Cell &cell) {
-            rapidjson::Value o(rapidjson::kObjectType);
-            auto ob = o.GetObject();
-            ob.AddMember("x", cell.position.x, allocator)
-                    .AddMember("y", cell.position.y, allocator)
-                    .AddMember("v", (int) cell.velocity, allocator);
-            if (cell.selected) {
-                ob.AddMember("s", (bool) cell.selected, allocator);
+    // Files from older versions, keys in any order, and cells out of order or on top of each other
+    void test_json_reader() {
+        const auto state = State::from_json_string(R"({"selected": 3, "unknown": {"a": [1, {"b": 2}]}, "patterns": [
+            {"id": 3, "width": 8, "height": 128, "first_note": 0, "last_note": 15, "extra": [[1]],
+             "cells": [{"x": 0, "y": 5, "v": 90, "s": true, "n": 3}, {"x": 1, "y": 7, "v": 80},
+                       {"x": 2, "y": 5, "v": 70}, {"x": 0, "y": 2, "v": 60, "s": false}],
+             "lanes": [{"y": 4, "t": 10, "v": 50}, {"y": 4, "t": 5, "v": 40, "n": 2}]},
+            {"cells": [{"x": 1, "y": 0, "v": 1}], "id": 4, "width": 4, "height": 1, "first_note": 16,
+             "last_note": 16, "speed": 2, "default_velocity": 10, "viewport": {"y": 1, "x": 0.5},
+             "cursor_x": 2}]})");
+
+        State expected;
+        auto &a = expected.add_pattern(Pattern(3, 8, 128, 0, 15, V2i(0, 0)));
+        a.set_default_velocity(127);
+        // (2, 5) starts under the first note and cuts it short
+        a.set_velocity(V2i(0, 5), 90);
+        a.set_length(V2i(0, 5), 2);
+        a.set_velocity(V2i(1, 7), 80);
+        a.set_velocity(V2i(2, 5), 70);
+        a.set_velocity(V2i(0, 2), 60);
+        a.set_lane_event(4, {10, 50, 1});
+        a.set_lane_event(4, {5, 40, 2});
+        auto &b = expected.add_pattern(Pattern(4, 4, 1, 16, 16, V2i(2, 0)));
+        b.set_speed(2.0f);
+        b.set_default_velocity(10);
+        b.set_viewport(V2f(0.5f, 1.0f));
+        b.set_velocity(V2i(1, 0), 1);
+        expected.set_selected_id(3);
+
+        assert(state.content_hash() == expected.content_hash());
+        assert(state.get_pattern(3).get_length(V2i(0, 5)) == 2 && state.get_pattern(3).get_velocity(V2i(2, 5)) == 70);
+        assert(!state.play_selected && !state.play_note_triggered && state.settings.empty());
+    }
+
+    void test_column_masks() {
+        Pattern p(0);
+        p.set_velocity(V2i(0, 10), 100);
+        p.set_velocity(V2i(0, 3), 90);
+        p.set_velocity(V2i(0, 100), 70);
+        p.set_velocity(V2i(2, 5), 80);
+        p.set_length(V2i(2, 5), 3);
+        p.set_velocity(V2i(4, 7), 0);
+        p.set_velocity(V2i(31, 127), 1);
+        assert(p.exists(V2i(3, 5)) && p.exists(V2i(4, 5)) && !p.exists(V2i(5, 5)));
+        assert(p.is_extension_of_tied(V2i(4, 5)) && !p.is_extension_of_tied(V2i(2, 5)));
+        assert(p.get_velocity(V2i(4, 5)) == 80 && p.get_length(V2i(3, 5)) == 3);
+        assert(p.get_cell(V2i(4, 5)).position == V2i(2, 5));
+
+        std::vector<ScheduledNote> expected;
+        for (int x = 0; x < p.width; x++) {
+            for (int y = 0; y < p.height; y++) {
+                const auto v = V2i(x, y);
+                if (!p.is_extension_of_tied(v) && p.get_velocity(v) > 0) {
+                    expected.push_back({x, utils::row_index_to_midi_note(y), p.get_velocity(v), p.get_length(v)});
+                }
             }
-            if (cell.length > 1) {
-                ob.AddMember("n", cell.length, allocator);
+        }
+        std::vector<ScheduledNote> notes;
+        for (int x = 0; x < p.width; x++) {
+            p.each_note_in_column(x, [&](const ScheduledNote &sn) {
+                notes.push_back(sn);
+            });
+        }
+        assert(notes.size() == expected.size());
+        for (std::size_t i = 0; i < expected.size(); i++) {
+            const auto &a = notes[i];
+            const auto &b = expected[i];
+            assert(a.column == b.column && a.note == b.note && a.velocity == b.velocity && a.length == b.length);
+        }
+        assert(p.has_notes_in_column(4) && !p.has_notes_in_column(3));
+
+        // a note growing over another one replaces it, clearing an extension clears the whole note
+        p.set_velocity(V2i(1, 10), 60);
+        p.set_length(V2i(0, 10), 3);
+        assert(!p.exists(V2i(3, 10)) && p.get_velocity(V2i(1, 10)) == 100);
+        p.set_length(V2i(0, 10), 1);
+        assert(!p.exists(V2i(1, 10)));
+        p.clear_cell(V2i(3, 5));
+        assert(!p.exists(V2i(2, 5)) && !p.exists(V2i(4, 5)));
+        assert(p.get_velocity(V2i(0, 3)) == 90 && p.get_velocity(V2i(0, 100)) == 70);
+
+        // each_selected_cell tolerates the callback clearing cells
+        Selection selection;
+        p.set_selected(selection, V2i(0, 3), true);
+        p.set_selected(selection, V2i(0, 100), true);
+        assert(selection.count() == 2);
+        int count = 0;
+        p.each_selected_cell(selection, [&](const Cell &c) {
+            p.clear_cell(c.position);
+            count++;
+        });
+        assert(count == 2 && p.get_velocity(V2i(0, 10)) == 100);
+        p.each_selected_cell(selection, [&](const Cell &) {
+            assert(false);
+        });
+
+        p.set_length(V2i(31, 127), 1);
+        p.set_velocity(V2i(20, 0), 5);
+        p.set_length(V2i(20, 0), 10);
+        p.resize_width(25);
+        assert(p.get_length(V2i(20, 0)) == 5 && !p.exists(V2i(31, 127)));
+        p.resize_width(32);
+        assert(!p.exists(V2i(25, 0)) && p.get_velocity(V2i(20, 0)) == 5);
+
+        // long patterns, notes in and across chunks
+        Pattern q(1);
+        q.resize_width(Pattern::MAX_WIDTH);
+        q.set_velocity(V2i(10, 20), 100);
+        q.set_length(V2i(10, 20), 3000);
+        q.set_velocity(V2i(63, 1), 50);
+        q.set_velocity(V2i(64, 1), 51);
+        q.set_velocity(V2i(4095, 127), 52);
+        assert(q.get_cell(V2i(2900, 20)).position == V2i(10, 20) && q.get_length(V2i(3009, 20)) == 3000);
+        assert(!q.exists(V2i(3010, 20)));
+        assert(q.next_column_with_notes(0) == 10 && q.next_column_with_notes(11) == 63);
+        assert(q.next_column_with_notes(65) == 4095 && q.next_column_with_notes(4095) == 4095);
+        int cells = 0;
+        q.each_cell([&](const Cell &) {
+            cells++;
+        });
+        assert(cells == 4);
+        const auto copy = q;
+        q.clear_cell(V2i(64, 1));
+        assert(copy.get_velocity(V2i(64, 1)) == 51 && q.next_column_with_notes(64) == 4095);
+        q.resize_width(1000);
+        assert(q.get_length(V2i(10, 20)) == 990 && !q.exists(V2i(999, 127)));
+        assert(q.next_column_with_notes(64) == -1);
+        q.resize_width(2000);
+        assert(!q.exists(V2i(1000, 20)) && q.get_velocity(V2i(63, 1)) == 50);
+    }
+
+    void test_copy_on_write() {
+        State state;
+        for (int i = 0; i < 3; i++) {
+            state.create_pattern().set_velocity(V2i(i, 10), 100);
+        }
+        const auto copy = state;
+        for (std::size_t i = 0; i < state.num_patterns(); i++) {
+            assert(state.patterns[i].shares_with(copy.patterns[i]));
+        }
+        // only the pattern that is changed gets copied
+        state.get_pattern(1).set_velocity(V2i(5, 5), 50);
+        assert(state.patterns[0].shares_with(copy.patterns[0]));
+        assert(!state.patterns[1].shares_with(copy.patterns[1]));
+        assert(state.patterns[2].shares_with(copy.patterns[2]));
+        assert(copy.get_pattern(1).get_velocity(V2i(5, 5)) == 0);
+        assert(state.get_pattern(1).get_velocity(V2i(5, 5)) == 50);
+        assert(!state.patterns[1].is_shared());
+
+        auto rt = copy;
+        rt.prepare_for_realtime(16);
+        for (std::size_t i = 0; i < rt.num_patterns(); i++) {
+            assert(!rt.patterns[i].is_shared());
+        }
+        state.delete_pattern(0);
+        assert(copy.num_patterns() == 3 && copy.get_pattern(0).get_velocity(V2i(0, 10)) == 100);
+    }
+
+    void test_lanes() {
+        Pattern p(0);
+        p.set_lane_event(10, {700, 90, 100});
+        p.set_lane_event(10, {5, 80, 1});
+        p.set_lane_event(3, {4000, 70, 2000});
+        p.set_lane_event(10, {700, 91, 120});
+        assert(p.get_lane_event(10, 700)->velocity == 91 && p.get_lane_event(10, 700)->length == 120);
+        assert(!p.get_lane_event(10, 6).has_value() && !p.get_lane_event(11, 700).has_value());
+        std::vector<std::pair<int, int>> seen;
+        p.each_lane_event([&](int row, const LaneEvent &e) {
+            seen.emplace_back(row, e.offset);
+        });
+        assert((seen == std::vector<std::pair<int, int>>{{3, 4000}, {10, 5}, {10, 700}}));
+        seen.clear();
+        p.each_lane_event_between(5, 700, [&](int row, const LaneEvent &e) {
+            seen.emplace_back(row, e.offset);
+        });
+        assert((seen == std::vector<std::pair<int, int>>{{10, 5}}));
+        assert(p.next_lane_offset(0) == 5 && p.next_lane_offset(6) == 700 && p.next_lane_offset(701) == 4000);
+        assert(p.next_lane_offset(4001) == -1);
+
+        // grid cells and lanes do not interfere
+        p.set_velocity(V2i(0, 10), 100);
+        p.clear_cell(V2i(0, 10));
+        assert(p.get_lane_event(10, 5).has_value());
+
+        const auto state = [&] {
+            State s;
+            s.add_pattern(p);
+            return State::from_json_string(s.to_json_string().c_str());
+        }();
+        const auto &q = state.get_pattern(0);
+        assert(q.get_lane_event(3, 4000)->length == 2000 && q.get_lane_event(10, 5)->velocity == 80);
+
+        p.resize_width(8);
+        assert(!p.get_lane_event(3, 4000).has_value() && p.next_lane_offset(701) == -1);
+        p.clear_lane_event(10, 5);
+        p.clear_lane_event(10, 700);
+        assert(!p.has_lane_events());
+    }
+
+    // The hash follows the content, not the edits that led to it
+    void test_content_hash() {
+        std::mt19937 rng(99);
+        auto rand_int = [&](int lo, int hi) {
+            return std::uniform_int_distribution<int>(lo, hi)(rng);
+        };
+        State state;
+        auto &p = state.create_pattern();
+        p.resize_width(200);
+        const auto empty = p.content_hash();
+        for (int i = 0; i < 2000; i++) {
+            const V2i v(rand_int(0, p.width - 1), rand_int(100, 127));
+            switch (rand_int(0, 7)) {
+                case 0:
+                case 1:
+                    p.set_velocity(v, (uint8_t) rand_int(0, 127));
+                    break;
+                case 2:
+                    p.clear_cell(v);
+                    break;
+                case 3:
+                    if (p.exists(v)) {
+                        const auto c = p.get_cell(v);
+                        p.set_length(c.position, rand_int(1, std::min(70, p.width - c.position.x)));
+                    }
+                    break;
+                case 4: {
+                    Selection selection;
+                    p.set_selected(selection, v, true);
+                    p.move_selected_cells(selection, V2i(0, rand_int(-1, 1)));
+                    break;
+                }
+                case 5: {
+                    // selecting is not part of the content
+                    const auto before = p.content_hash();
+                    Selection selection;
+                    p.select_all(selection);
+                    assert(p.content_hash() == before);
+                    break;
+                }
+                case 6:
+                    p.set_lane_event(v.y, {rand_int(0, p.lane_ticks() - 1), (uint8_t) rand_int(1, 127),
+                                           rand_int(1, 100)});
+                    break;
+                case 7:
+                    p.resize_width(rand_int(150, 200));
+                    break;
+                default:
+                    break;
+            }
+            if (i % 100 == 0) {
+                const auto loaded = State::from_json_string(state.to_json_string().c_str());
+                assert(loaded.content_hash() == state.content_hash());
             }
-            data_arr.PushBack(o, allocator);
+        }
+        const auto before = state.content_hash();
+        const auto copy = p;
+        p.set_velocity(V2i(0, 0), 1);
+        p.set_lane_event(0, {0, 1, 1});
+        p.cursor.x += 1;
+        assert(state.content_hash() != before);
+        p.cursor.x -= 1;
+        p.clear_cell(V2i(0, 0));
+        p.clear_lane_event(0, 0);
+        assert(state.content_hash() == before && copy.content_hash() == p.content_hash());
+        state.play_selected = !state.play_selected;
+        assert(state.content_hash() != before);
+
+        // emptied by hand it is the empty pattern again
+        p.resize_width(1);
+        std::vector<std::pair<int, int>> lane_events;
+        p.each_lane_event([&](int row, const LaneEvent &e) {
+            lane_events.emplace_back(row, e.offset);
         });
-        pobj.GetObject().AddMember("cells", data_arr, allocator);
-        return pobj;
+        for (const auto &e: lane_events) {
+            p.clear_lane_event(e.first, e.second);
+        }
+        for (int row = 100; row < 128; row++) {
+            p.clear_cell(V2i(0, row));
+        }
+        p.resize_width(200);
+        assert(p.content_hash() == empty);
     }
 
-    struct Opaque {
-        rapidjson::Document d;
+    void test_selection() {
+        Pattern p(0);
+        p.resize_width(300);
+        p.set_velocity(V2i(2, 10), 100);
+        p.set_length(V2i(2, 10), 4);
+        p.set_velocity(V2i(250, 20), 90);
+        p.set_velocity(V2i(100, 10), 80);
+        Selection selection;
+        p.set_selected(selection, V2i(4, 10), true);
+        assert(p.get_selected(selection, V2i(2, 10)) && p.get_selected(selection, V2i(5, 10)));
+        assert(!p.get_selected(selection, V2i(6, 10)) && !p.get_selected(selection, V2i(100, 10)));
+        assert(selection.count() == 1 && selection.get_box_min() == V2i(2, 10));
+
+        p.select_all(selection);
+        assert(selection.count() == 3 && selection.get_box_min() == V2i(2, 10));
+        assert(selection.get_box_max() == V2i(250, 20));
+        std::vector<V2i> seen;
+        p.each_selected_cell(selection, [&](const Cell &c) {
+            seen.push_back(c.position);
+        });
+        assert((seen == std::vector<V2i>{V2i(2, 10), V2i(100, 10), V2i(250, 20)}));
+
+        // moved cells stay selected and wrap around
+        p.move_selected_cells(selection, V2i(100, 1));
+        assert(p.get_length(V2i(102, 11)) == 4 && p.get_velocity(V2i(50, 21)) == 90);
+        assert(!p.exists(V2i(2, 10)) && selection.count() == 3);
+        assert(selection.test(V2i(50, 21)) && selection.test(V2i(200, 11)) && !selection.test(V2i(250, 20)));
+
+        p.cursor = V2i(0, 11);
+        p.select_row(selection);
+        assert(selection.count() == 2 && !selection.test(V2i(50, 21)));
+        selection.reset(V2i(102, 11));
+        p.clear_cell(V2i(200, 11));
+        assert(selection.count() == 1);
+        p.each_selected_cell(selection, [&](const Cell &) {
+            assert(false);
+        });
+        selection.clear();
+        assert(selection.empty() && !selection.test(V2i(200, 11)));
+    }
+
+    // replace_notes() against the same rules applied note by note to a plain map of notes
+    void test_replace_notes() {
+        std::mt19937 rng(5);
+        auto rand_int = [&](int lo, int hi) {
+            return std::uniform_int_distribution<int>(lo, hi)(rng);
+        };
+        for (int round = 0; round < 20; round++) {
+            Pattern p(0);
+            p.resize_width(rand_int(1, 300));
+            // by row and then start
+            std::map<std::pair<int, int>, Cell> expected;
+            auto covering = [&](const V2i &v) {
+                auto it = expected.upper_bound({v.y, v.x});
+                if (it == expected.begin()) {
+                    return expected.end();
+                }
+                --it;
+                const auto &c = it->second;
+                return c.position.y == v.y && c.position.x + c.length > v.x ? it : expected.end();
+            };
+            for (int step = 0; step < 30; step++) {
+                std::vector<V2i> erase;
+                std::vector<Cell> notes;
+                for (int i = rand_int(0, 5); i > 0; i--) {
+                    erase.emplace_back(rand_int(0, p.width - 1), rand_int(60, 70));
+                }
+                for (int i = rand_int(0, 40); i > 0; i--) {
+                    notes.push_back({V2i(rand_int(-2, p.width + 1), rand_int(60, 70)), (uint8_t) rand_int(0, 127),
+                                     rand_int(1, 80)});
+                }
+
+                for (const auto &v: erase) {
+                    const auto it = covering(v);
+                    if (it != expected.end()) {
+                        expected.erase(it);
+                    }
+                }
+                std::map<std::pair<int, int>, Cell> put;
+                for (const auto &c: notes) {
+                    if (c.position.x >= 0 && c.position.x < p.width) {
+                        put[{c.position.y, c.position.x}] = c;
+                    }
+                }
+                for (auto it = put.begin(); it != put.end(); ++it) {
+                    const auto next = std::next(it);
+                    auto &c = it->second;
+                    const auto end = next != put.end() && next->first.first == c.position.y ? next->first.second : p.width;
+                    c.length = std::min(c.length, end - c.position.x);
+                }
+                for (const auto &[key, c]: put) {
+                    for (int x = c.position.x; x < c.position.x + c.length; x++) {
+                        expected.erase({c.position.y, x});
+                    }
+                    const auto it = covering(c.position);
+                    if (it != expected.end()) {
+                        it->second.length = c.position.x - it->second.position.x;
+                    }
+                }
+                expected.insert(put.begin(), put.end());
+
+                const auto result = p.replace_notes(erase, notes);
+                assert(result.size() == put.size());
+
+                Pattern q(0);
+                q.resize_width(p.width);
+                std::size_t count = 0;
+                p.each_cell([&](const Cell &c) {
+                    const auto it = expected.find({c.position.y, c.position.x});
+                    assert(it != expected.end() && it->second.velocity == c.velocity && it->second.length == c.length);
+                    count++;
+                });
+                assert(count == expected.size());
+                for (const auto &[key, c]: expected) {
+                    q.set_velocity(c.position, c.velocity);
+                    q.set_length(c.position, c.length);
+                    for (int x = c.position.x + 1; x < c.position.x + c.length; x++) {
+                        assert(p.is_extension_of_tied(V2i(x, c.position.y)));
+                    }
+                }
+                for (int x = 0; x < p.width; x++) {
+                    for (int y = 60; y <= 70; y++) {
+                        assert(p.is_extension_of_tied(V2i(x, y)) == q.is_extension_of_tied(V2i(x, y)));
+                    }
+                }
+                assert(p.content_hash() == q.content_hash());
+            }
+        }
+    }
+
+    void test_pattern_index() {
+        State state;
+        const auto a = state.create_pattern().id;
+        const auto b = state.create_pattern().id;
+        const auto c = state.duplicate_pattern(b).id;
+        assert(a == 0 && b == 1 && c == 2);
+        assert(state.get_pattern(c).id == c);
+        state.delete_pattern(b);
+        assert(!state.has_pattern(b));
+        assert(state.find_pattern(b) == nullptr);
+        assert(state.find_pattern(-1) == nullptr);
+        assert(state.find_pattern(100) == nullptr);
+        assert(state.get_pattern(a).id == a);
+        assert(state.get_pattern(c).id == c);
+        state.delete_pattern(c);
+        assert(state.next_unused_id() == a + 1);
+        const auto state1 = State::from_json_string(state.to_json_string().c_str());
+        assert(state1.get_pattern(a).id == a);
+        assert(!state1.has_pattern(c));
+
+        // of two patterns with the same id the first one is found, and rebuild_index() reports it
+        State twins;
+        twins.patterns.emplace_back(Pattern(5));
+        twins.patterns.emplace_back(Pattern(5));
+        twins.patterns.back().mutate().set_speed(2.0f);
+        assert(!twins.rebuild_index());
+        assert(twins.get_pattern(5).get_speed() == 1.0f);
+        twins.patterns.pop_back();
+        assert(twins.rebuild_index());
+
+        state.get_pattern(a).set_note_trigger_range(10, 4);
+        state.rebuild_trigger_table();
+        int count = 0;
+        state.each_trigger_target(12, [&](const TriggerTarget &t) {
+            assert(t.pattern_id == a);
+            assert(t.start_offset == 0.5f);
+            count++;
+        });
+        assert(count == 1);
+        state.each_trigger_target(14, [&](const TriggerTarget &) {
+            assert(false);
+        });
+    }
+
+    // rapidjson output stream that appends to a string, so that callers can reuse its capacity
+    struct StringOutputStream {
+        typedef char Ch;
+        std::string &out;
+
+        void Put(char c) {
+            out.push_back(c);
+        }
+
+        void Flush() {}
     };
 
-    [[nodiscard]] Opaque State::to_json() const {
-        rapidjson::Document d;
-        d.SetObject();
-        d.GetObject().AddMember("selected", this->selected, d.GetAllocator());
-        d.GetObject().AddMember("play_selected", this->play_selected, d.GetAllocator());
-        d.GetObject().AddMember("play_note_triggered", this->play_note_triggered, d.GetAllocator());
-        d.GetObject().AddMember("settings", rapidjson::StringRef(this->settings.c_str()), d.GetAllocator());
-        rapidjson::Value patterns_arr(rapidjson::kArrayType);
-        for (auto p: this->patterns) {
-            rapidjson::Value o = pattern_to_json(p, d.GetAllocator());
-            patterns_arr.PushBack(o, d.GetAllocator());
+    template<typename Writer>
+    void write_pattern_json(Writer &w, const Pattern &pattern) {
+        if (!pattern.is_decoded()) {
+            write_pattern_json(w, pattern.decoded());
+            return;
         }
-        d.GetObject().AddMember("patterns", patterns_arr, d.GetAllocator());
-        return Opaque{std::move(d)};
+        w.StartObject();
+        w.Key("width");
+        w.Int(pattern.width);
+        w.Key("id");
+        w.Int(pattern.id);
+        w.Key("height");
+        w.Int(pattern.height);
+        w.Key("first_note");
+        w.Int(pattern.get_first_note());
+        w.Key("last_note");
+        w.Int(pattern.get_last_note());
+        w.Key("cursor_x");
+        w.Int(pattern.cursor.x);
+        w.Key("cursor_y");
+        w.Int(pattern.cursor.y);
+        w.Key("speed");
+        w.Double(pattern.get_speed());
+        w.Key("default_velocity");
+        w.Int(pattern.get_default_velocity());
+        w.Key("viewport");
+        w.StartObject();
+        w.Key("x");
+        w.Double(pattern.get_viewport().x);
+        w.Key("y");
+        w.Double(pattern.get_viewport().y);
+        w.EndObject();
+        w.Key("cells");
+        w.StartArray();
+        pattern.each_cell([&](const Cell &cell) {
+            w.StartObject();
+            w.Key("x");
+            w.Int(cell.position.x);
+            w.Key("y");
+            w.Int(cell.position.y);
+            w.Key("v");
+            w.Int(cell.velocity);
+            if (cell.length > 1) {
+                w.Key("n");
+                w.Int(cell.length);
+            }
+            w.EndObject();
+        });
+        w.EndArray();
+        if (pattern.has_lane_events()) {
+            w.Key("lanes");
+            w.StartArray();
+            pattern.each_lane_event([&](int row, const LaneEvent &e) {
+                w.StartObject();
+                w.Key("y");
+                w.Int(row);
+                w.Key("t");
+                w.Int(e.offset);
+                w.Key("v");
+                w.Int(e.velocity);
+                if (e.length > 1) {
+                    w.Key("n");
+                    w.Int(e.length);
+                }
+                w.EndObject();
+            });
+            w.EndArray();
+        }
+        w.EndObject();
+    }
+
+    template<typename Writer>
+    void write_state_json(Writer &w, const State &state) {
+        w.StartObject();
+        w.Key("selected");
+        w.Int(state.get_selected_id());
+        w.Key("play_selected");
+        w.Bool(state.play_selected);
+        w.Key("play_note_triggered");
+        w.Bool(state.play_note_triggered);
+        w.Key("settings");
+        w.String(state.settings.data(), static_cast<rapidjson::SizeType>(state.settings.size()));
+        w.Key("patterns");
+        w.StartArray();
+        for (const auto &p: state.patterns) {
+            write_pattern_json(w, *p);
+        }
+        w.EndArray();
+        w.EndObject();
+    }
+
+    [[nodiscard]] std::string Pattern::to_json_string() const {
+        std::string out;
+        StringOutputStream stream{out};
+        rapidjson::Writer<StringOutputStream> writer(stream);
+        write_pattern_json(writer, *this);
+        return out;
+    }
+
+    void State::write_json(std::string &out) const {
+        out.clear();
+        StringOutputStream stream{out};
+        rapidjson::Writer<StringOutputStream> writer(stream);
+        write_state_json(writer, *this);
     }
 
     [[nodiscard]] std::string State::to_json_string() const {
-        rapidjson::StringBuffer buffer;
-        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-        to_json().d.Accept(writer);
-        const auto s = buffer.GetString();
-        return s;
+        std::string out;
+        write_json(out);
+        return out;
+    }
+
+    bool State::write_json_file(const char *state_file) const {
+        FILE *file = fopen(state_file, "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        char buffer[65536];
+        rapidjson::FileWriteStream stream(file, buffer, sizeof(buffer));
+        rapidjson::Writer<rapidjson::FileWriteStream> writer(stream);
+        write_state_json(writer, *this);
+        stream.Flush();
+        return fclose(file) == 0;
+    }
+
+    // Binary state. Numbers are little-endian, varints are LEB128 and svarints zigzag LEB128.
+    //
+    //   "MSQB", u8 version
+    //   varint flags (1 play_selected, 2 play_note_triggered), svarint selected,
+    //   varint settings length, the settings, varint pattern count, and for every pattern:
+    //     svarint id, varint width, varint height, svarint first_note, svarint last_note,
+    //     svarint cursor x, svarint cursor y, f32 speed, u8 default_velocity, f32 viewport x, f32 viewport y
+    //     u64 items hash (see Pattern::items_hash), varint size of the cells that follow, and the cells:
+    //     varint columns with notes, for each: varint empty columns before it, varint notes,
+    //       for each note: varint (empty rows before it << 2 | VELOCITY | LENGTH),
+    //       u8 velocity if VELOCITY, varint length - 2 if LENGTH
+    //     varint lane events, for each: varint (rows since the previous event << 2 | VELOCITY | LENGTH),
+    //       u8 velocity if VELOCITY, varint length - 2 if LENGTH,
+    //       varint ticks since the previous event in the same row
+    //
+    // Columns and rows count from the previous one with notes, so empty stretches cost nothing.
+    // Without VELOCITY the velocity is that of the previous note or event of the pattern,
+    // default_velocity for the first one, without LENGTH the length is 1.
+    // The hash and size let a reader skip the cells and decode them later. Version 1 has neither,
+    // its cells follow the header directly and are decoded on load.
+    // Bump the version when the layout or item_hash() changes, readers refuse versions they do not know
+    constexpr char BINARY_MAGIC[4] = {'M', 'S', 'Q', 'B'};
+    constexpr uint8_t BINARY_VERSION = 2;
+    constexpr uint8_t BINARY_VERSION_WITH_SIZES = 2;
+    constexpr uint64_t BINARY_VELOCITY = 1;
+    constexpr uint64_t BINARY_LENGTH = 2;
+
+    class BinaryWriter {
+        std::string &out;
+
+    public:
+        explicit BinaryWriter(std::string &out) : out(out) {}
+
+        void u8(uint8_t v) {
+            out.push_back(static_cast<char>(v));
+        }
+
+        void u64(uint64_t v) {
+            for (int i = 0; i < 8; i++) {
+                u8(static_cast<uint8_t>(v >> (8 * i)));
+            }
+        }
+
+        void varint(uint64_t v) {
+            while (v >= 0x80) {
+                u8(static_cast<uint8_t>(v | 0x80));
+                v >>= 7;
+            }
+            u8(static_cast<uint8_t>(v));
+        }
+
+        void svarint(int64_t v) {
+            varint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+        }
+
+        void f32(float f) {
+            const auto bits = static_cast<uint32_t>(utils::float_bits(f));
+            for (int i = 0; i < 4; i++) {
+                u8(static_cast<uint8_t>(bits >> (8 * i)));
+            }
+        }
+
+        void bytes(const char *data, std::size_t size) {
+            out.append(data, size);
+        }
+    };
+
+    // Exits on malformed input like from_json_string() does
+    class BinaryReader {
+        const uint8_t *pos;
+        const uint8_t *end;
+
+    public:
+        BinaryReader(const char *data, std::size_t size) : pos(reinterpret_cast<const uint8_t *>(data)),
+                                                           end(reinterpret_cast<const uint8_t *>(data) + size) {}
+
+        [[noreturn]] static void fail(const char *what) {
+            fprintf(stderr, "binary state error: %s\n", what);
+            exit(EXIT_FAILURE);
+        }
+
+        static void check(bool ok, const char *what) {
+            if (!ok) {
+                fail(what);
+            }
+        }
+
+        uint8_t u8() {
+            check(pos < end, "unexpected end");
+            return *pos++;
+        }
+
+        uint64_t u64() {
+            uint64_t v = 0;
+            for (int i = 0; i < 8; i++) {
+                v |= uint64_t(u8()) << (8 * i);
+            }
+            return v;
+        }
+
+        uint64_t varint() {
+            uint64_t v = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                const auto b = u8();
+                v |= uint64_t(b & 0x7f) << shift;
+                if ((b & 0x80) == 0) {
+                    return v;
+                }
+            }
+            fail("varint too long");
+        }
+
+        // varint that has to be at most max
+        int bounded(uint64_t max, const char *what) {
+            const auto v = varint();
+            check(v <= max, what);
+            return static_cast<int>(v);
+        }
+
+        int svarint() {
+            const auto v = varint();
+            const auto s = static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+            check(s >= std::numeric_limits<int>::min() && s <= std::numeric_limits<int>::max(), "svarint too large");
+            return static_cast<int>(s);
+        }
+
+        float f32() {
+            uint32_t bits = 0;
+            for (int i = 0; i < 4; i++) {
+                bits |= uint32_t(u8()) << (8 * i);
+            }
+            float f;
+            std::memcpy(&f, &bits, sizeof(f));
+            return f;
+        }
+
+        std::string bytes(std::size_t size) {
+            return std::string(skip(size));
+        }
+
+        // The next size bytes, without copying them
+        std::string_view skip(std::size_t size) {
+            check(size <= static_cast<std::size_t>(end - pos), "unexpected end");
+            const std::string_view s(reinterpret_cast<const char *>(pos), size);
+            pos += size;
+            return s;
+        }
+
+        [[nodiscard]] bool at_end() const {
+            return pos == end;
+        }
+    };
+
+    // Binary encoding of a pattern, with access to the encoded cells and the hash that goes with them
+    class PatternCodec {
+        static void write_cells(const Pattern &pattern, BinaryWriter &w) {
+            int columns = 0;
+            for (auto x = pattern.next_column_with_notes(0); x >= 0; x = pattern.next_column_with_notes(x + 1)) {
+                columns++;
+            }
+            w.varint(columns);
+            auto velocity = pattern.get_default_velocity();
+            auto write_item = [&](int skipped, uint8_t item_velocity, int length) {
+                const auto flags =
+                        (item_velocity != velocity ? BINARY_VELOCITY : 0) | (length > 1 ? BINARY_LENGTH : 0);
+                w.varint((uint64_t(skipped) << 2) | flags);
+                if (flags & BINARY_VELOCITY) {
+                    w.u8(item_velocity);
+                    velocity = item_velocity;
+                }
+                if (flags & BINARY_LENGTH) {
+                    w.varint(length - 2);
+                }
+            };
+
+            // each_cell goes column by column, a column is written once it is complete
+            int previous_x = -1;
+            std::array<Cell, 128> column{};
+            int column_size = 0;
+            auto write_column = [&]() {
+                if (column_size == 0) {
+                    return;
+                }
+                const auto x = column[0].position.x;
+                w.varint(x - previous_x - 1);
+                w.varint(column_size);
+                int previous_row = -1;
+                for (int i = 0; i < column_size; i++) {
+                    const auto &cell = column[i];
+                    write_item(cell.position.y - previous_row - 1, cell.velocity, cell.length);
+                    previous_row = cell.position.y;
+                }
+                previous_x = x;
+                column_size = 0;
+            };
+            pattern.each_cell([&](const Cell &cell) {
+                if (column_size > 0 && column[0].position.x != cell.position.x) {
+                    write_column();
+                }
+                column[column_size++] = cell;
+            });
+            write_column();
+
+            int lane_events = 0;
+            pattern.each_lane_event([&](int, const LaneEvent &) {
+                lane_events++;
+            });
+            w.varint(lane_events);
+            int previous_row = 0;
+            int previous_offset = 0;
+            pattern.each_lane_event([&](int row, const LaneEvent &e) {
+                if (row != previous_row) {
+                    previous_offset = 0;
+                }
+                write_item(row - previous_row, e.velocity, e.length);
+                w.varint(e.offset - previous_offset);
+                previous_row = row;
+                previous_offset = e.offset;
+            });
+        }
+
+        // Fills the empty pattern with the cells r is at
+        static Pattern read_cells(BinaryReader &r, Pattern p) {
+            const auto width = p.width;
+            const auto height = p.height;
+            auto velocity = p.get_default_velocity();
+            PatternBuilder builder(std::move(p));
+
+            // returns the rows skipped
+            auto read_item = [&](uint64_t max_skipped, int max_length, uint8_t &item_velocity, int &length) {
+                const auto v = r.varint();
+                BinaryReader::check((v >> 2) <= max_skipped, "row out of range");
+                if (v & BINARY_VELOCITY) {
+                    velocity = r.u8();
+                }
+                item_velocity = velocity;
+                length = (v & BINARY_LENGTH) ? 2 + r.bounded(std::max(0, max_length - 2), "note too long") : 1;
+                BinaryReader::check(length <= max_length, "note too long");
+                return static_cast<int>(v >> 2);
+            };
+
+            const auto columns = r.bounded(width, "too many columns");
+            int x = -1;
+            for (int i = 0; i < columns; i++) {
+                x += 1 + r.bounded(width, "column out of range");
+                BinaryReader::check(x < width, "column out of range");
+                const auto notes = r.bounded(height, "too many notes in a column");
+                int row = -1;
+                for (int j = 0; j < notes; j++) {
+                    uint8_t note_velocity;
+                    int length;
+                    row += 1 + read_item(height, width - x, note_velocity, length);
+                    BinaryReader::check(row < height, "row out of range");
+                    builder.add_note(V2i(x, row), note_velocity, length);
+                }
+            }
+
+            const auto lane_events = r.varint();
+            const auto lane_ticks = width * Pattern::LANE_TICKS_PER_STEP;
+            int row = 0;
+            int offset = 0;
+            for (uint64_t i = 0; i < lane_events; i++) {
+                uint8_t event_velocity;
+                int length;
+                const auto rows = read_item(height - 1, std::numeric_limits<int>::max(), event_velocity, length);
+                if (rows > 0) {
+                    offset = 0;
+                }
+                row += rows;
+                BinaryReader::check(row < height, "lane row out of range");
+                offset += r.bounded(lane_ticks - 1, "lane offset out of range");
+                BinaryReader::check(offset < lane_ticks, "lane offset out of range");
+                builder.add_lane_event(row, {offset, event_velocity, length});
+            }
+            return builder.build();
+        }
+
+    public:
+        // cells is scratch space for encoding them
+        static void write(const Pattern &pattern, BinaryWriter &w, std::string &cells) {
+            w.svarint(pattern.id);
+            w.varint(pattern.width);
+            w.varint(pattern.height);
+            w.svarint(pattern.get_first_note());
+            w.svarint(pattern.get_last_note());
+            w.svarint(pattern.cursor.x);
+            w.svarint(pattern.cursor.y);
+            w.f32(pattern.get_speed());
+            w.u8(pattern.get_default_velocity());
+            w.f32(pattern.get_viewport().x);
+            w.f32(pattern.get_viewport().y);
+            w.u64(pattern.items_hash);
+            if (!pattern.is_decoded()) {
+                // still the bytes they were loaded from
+                w.varint(pattern.encoded_cells.size());
+                w.bytes(pattern.encoded_cells.data(), pattern.encoded_cells.size());
+                return;
+            }
+            cells.clear();
+            BinaryWriter cells_writer(cells);
+            write_cells(pattern, cells_writer);
+            w.varint(cells.size());
+            w.bytes(cells.data(), cells.size());
+        }
+
+        // From version 2 on the cells stay in bytes, which r reads from
+        static Pattern read(BinaryReader &r, uint8_t version, const std::shared_ptr<const std::string> &bytes) {
+            const auto id = r.svarint();
+            const auto width = r.bounded(Pattern::MAX_WIDTH, "pattern too wide");
+            const auto height = r.bounded(128, "pattern too high");
+            BinaryReader::check(id >= 0 && id < State::MAX_PATTERN_ID && width >= 1 && height >= 1,
+                                "bad pattern header");
+            const auto first_note = r.svarint();
+            const auto last_note = r.svarint();
+            const auto cursor_x = r.svarint();
+            const auto cursor_y = r.svarint();
+            Pattern p(id, width, height, first_note, last_note, V2i(cursor_x, cursor_y));
+            p.set_speed(r.f32());
+            p.set_default_velocity(r.u8());
+            const auto viewport_x = r.f32();
+            p.set_viewport(V2f(viewport_x, r.f32()));
+            if (version < BINARY_VERSION_WITH_SIZES) {
+                return read_cells(r, std::move(p));
+            }
+            p.items_hash = r.u64();
+            p.encoded_cells = r.skip(r.varint());
+            p.encoded = bytes;
+            return p;
+        }
+
+        static Pattern decode(const Pattern &pattern) {
+            assert(!pattern.is_decoded());
+            Pattern p = pattern;
+            p.encoded.reset();
+            p.encoded_cells = {};
+            p.items_hash = 0;
+            BinaryReader r(pattern.encoded_cells.data(), pattern.encoded_cells.size());
+            auto decoded = read_cells(r, std::move(p));
+            BinaryReader::check(r.at_end(), "trailing bytes in pattern");
+            BinaryReader::check(decoded.items_hash == pattern.items_hash, "pattern does not match its hash");
+            return decoded;
+        }
+    };
+
+    Pattern Pattern::decoded() const {
+        return is_decoded() ? *this : PatternCodec::decode(*this);
+    }
+
+    [[nodiscard]] std::string State::to_binary() const {
+        std::string out;
+        write_binary(out);
+        return out;
+    }
+
+    void State::write_binary(std::string &out) const {
+        out.clear();
+        BinaryWriter w(out);
+        w.bytes(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        w.u8(BINARY_VERSION);
+        w.varint((play_selected ? 1 : 0) | (play_note_triggered ? 2 : 0));
+        w.svarint(selected);
+        w.varint(settings.size());
+        w.bytes(settings.data(), settings.size());
+        w.varint(patterns.size());
+        std::string cells;
+        for (const auto &p: patterns) {
+            PatternCodec::write(*p, w, cells);
+        }
+    }
+
+    State State::from_binary(const char *data, std::size_t size) {
+        return from_binary(std::make_shared<const std::string>(data, size));
+    }
+
+    State State::from_binary(std::shared_ptr<const std::string> bytes) {
+        BinaryReader r(bytes->data(), bytes->size());
+        BinaryReader::check(r.bytes(sizeof(BINARY_MAGIC)) == std::string(BINARY_MAGIC, sizeof(BINARY_MAGIC)),
+                            "not a binary state");
+        const auto version = r.u8();
+        BinaryReader::check(version <= BINARY_VERSION, "state is from a newer version");
+        State state;
+        const auto flags = r.varint();
+        state.play_selected = (flags & 1) != 0;
+        state.play_note_triggered = (flags & 2) != 0;
+        state.set_selected_id(r.svarint());
+        state.settings = r.bytes(r.varint());
+        const auto count = r.varint();
+        for (uint64_t i = 0; i < count; i++) {
+            state.patterns.emplace_back(PatternCodec::read(r, version, bytes));
+        }
+        BinaryReader::check(r.at_end(), "trailing bytes");
+        BinaryReader::check(state.rebuild_index(), "patterns with the same id");
+        return state;
+    }
+
+    constexpr char BASE64_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    [[nodiscard]] std::string to_base64(const std::string &data) {
+        std::string out;
+        out.reserve((data.size() + 2) / 3 * 4);
+        const auto *p = reinterpret_cast<const uint8_t *>(data.data());
+        std::size_t i = 0;
+        for (; i + 2 < data.size(); i += 3) {
+            const uint32_t v = (p[i] << 16) | (p[i + 1] << 8) | p[i + 2];
+            out.push_back(BASE64_DIGITS[v >> 18]);
+            out.push_back(BASE64_DIGITS[(v >> 12) & 63]);
+            out.push_back(BASE64_DIGITS[(v >> 6) & 63]);
+            out.push_back(BASE64_DIGITS[v & 63]);
+        }
+        if (i < data.size()) {
+            const bool two = i + 1 < data.size();
+            const uint32_t v = (p[i] << 16) | (two ? p[i + 1] << 8 : 0);
+            out.push_back(BASE64_DIGITS[v >> 18]);
+            out.push_back(BASE64_DIGITS[(v >> 12) & 63]);
+            out.push_back(two ? BASE64_DIGITS[(v >> 6) & 63] : '=');
+            out.push_back('=');
+        }
+        return out;
+    }
+
+    // Empty when s is not base64
+    [[nodiscard]] std::optional<std::string> from_base64(const char *s, std::size_t size) {
+        static const auto values = [] {
+            std::array<int8_t, 256> t{};
+            t.fill(-1);
+            for (int i = 0; i < 64; i++) {
+                t[static_cast<uint8_t>(BASE64_DIGITS[i])] = static_cast<int8_t>(i);
+            }
+            return t;
+        }();
+        while (size > 0 && s[size - 1] == '=') {
+            size--;
+        }
+        std::string out;
+        out.reserve(size * 3 / 4);
+        uint32_t v = 0;
+        int bits = 0;
+        for (std::size_t i = 0; i < size; i++) {
+            const auto d = values[static_cast<uint8_t>(s[i])];
+            if (d < 0) {
+                return {};
+            }
+            v = (v << 6) | static_cast<uint32_t>(d);
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                out.push_back(static_cast<char>((v >> bits) & 0xff));
+            }
+        }
+        return out;
+    }
+
+    [[nodiscard]] std::string State::to_base64() const {
+        return myseq::to_base64(to_binary());
+    }
+
+    State::FileFormat State::file_format_of(const char *s, std::size_t size) {
+        return size >= sizeof(BINARY_MAGIC) && std::memcmp(s, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0
+               ? FileFormat::Binary : FileFormat::Json;
+    }
+
+    State State::from_string(const char *s, std::size_t size) {
+        if (file_format_of(s, size) == FileFormat::Binary) {
+            return from_binary(s, size);
+        }
+        std::size_t first = 0;
+        while (first < size && std::isspace(static_cast<unsigned char>(s[first]))) {
+            first++;
+        }
+        if (first < size && s[first] == '{') {
+            return from_json_string(s);
+        }
+        auto decoded = from_base64(s, size);
+        if (!decoded.has_value()) {
+            BinaryReader::fail("neither JSON nor binary state");
+        }
+        return from_binary(std::make_shared<const std::string>(std::move(*decoded)));
+    }
+
+    void test_binary_state() {
+        std::mt19937 rng(7);
+        auto rand_int = [&](int lo, int hi) {
+            return std::uniform_int_distribution<int>(lo, hi)(rng);
+        };
+        auto round_trip = [](const State &state) {
+            const auto binary = state.to_binary();
+            assert(State::file_format_of(binary) == State::FileFormat::Binary);
+            assert(State::file_format_of(state.to_json_string()) == State::FileFormat::Json);
+            for (const auto &s: {binary, state.to_base64(), state.to_json_string()}) {
+                const auto loaded = State::from_string(s);
+                assert(loaded.content_hash() == state.content_hash());
+                assert(loaded.settings == state.settings);
+                assert(loaded.to_binary() == binary);
+            }
+        };
+
+        // anything that can be in a pattern
+        State state;
+        state.play_note_triggered = true;
+        state.settings = "[Window][Debug]\nPos=60,60\n";
+        for (int i = 0; i < 3; i++) {
+            auto &p = state.create_pattern();
+            p.resize_width(i == 0 ? 1 : rand_int(2, Pattern::MAX_WIDTH));
+            p.cursor = V2i(rand_int(0, p.width - 1), rand_int(0, 127));
+            p.set_speed(0.5f * (float) (i + 1));
+            p.set_viewport(V2f(-0.25f, 3.5f));
+            for (int j = 0; j < 500 * i; j++) {
+                const V2i v(rand_int(0, p.width - 1), rand_int(0, 127));
+                p.set_velocity(v, (uint8_t) rand_int(0, 127));
+                const auto c = p.get_cell(v);
+                p.set_length(c.position, rand_int(1, std::min(300, p.width - c.position.x)));
+                p.set_lane_event(v.y, {rand_int(0, p.lane_ticks() - 1), (uint8_t) rand_int(1, 127),
+                                       rand_int(1, 5000)});
+            }
+        }
+        state.set_selected_id(1);
+        round_trip(state);
+        round_trip(State());
+
+        // a drum pattern: few velocities, short notes
+        State drums;
+        auto &p = drums.create_pattern();
+        p.resize_width(256);
+        for (int x = 0; x < p.width; x++) {
+            for (int y = 112; y < 128; y++) {
+                if (rand_int(0, 3) == 0) {
+                    p.set_velocity(V2i(x, y), rand_int(0, 7) == 0 ? 60 : p.get_default_velocity());
+                }
+            }
+        }
+        round_trip(drums);
+        assert(drums.to_binary().size() * 10 < drums.to_json_string().size());
+
+        assert(myseq::to_base64("ab") == "YWI=" && *from_base64("YWI=", 4) == "ab");
+    }
+
+    void test_lazy_decoding() {
+        std::mt19937 rng(11);
+        auto rand_int = [&](int lo, int hi) {
+            return std::uniform_int_distribution<int>(lo, hi)(rng);
+        };
+        State state;
+        for (int i = 0; i < 4; i++) {
+            auto &p = state.create_pattern();
+            p.resize_width(64 * (i + 1));
+            for (int j = 0; j < 200; j++) {
+                p.set_velocity(V2i(rand_int(0, p.width - 1), rand_int(0, 127)), (uint8_t) rand_int(1, 127));
+            }
+            p.set_lane_event(5, {7, 90, 3});
+        }
+        state.set_selected_id(2);
+        const auto binary = state.to_binary();
+
+        // only headers are read, encoded patterns read as empty and are written out as they came
+        auto loaded = State::from_binary(binary.data(), binary.size());
+        for (const auto &p: loaded.patterns) {
+            assert(!p->is_decoded() && p->next_column_with_notes(0) < 0 && !p->has_lane_events());
+            assert(p->width == state.get_pattern(p->id).width);
+        }
+        assert(loaded.content_hash() == state.content_hash());
+        assert(loaded.to_binary() == binary);
+        assert(loaded.to_json_string() == state.to_json_string());
+
+        // non-const access decodes one pattern, in this State only
+        const auto copy = loaded;
+        auto &p2 = loaded.get_pattern(2);
+        assert(p2.is_decoded() && !std::as_const(loaded).get_pattern(1).is_decoded());
+        assert(!copy.get_pattern(2).is_decoded());
+        assert(p2.to_json_string() == state.get_pattern(2).to_json_string());
+        p2.set_velocity(V2i(0, 0), 1);
+        const auto &p4 = loaded.duplicate_pattern(3);
+        auto expected = state.get_pattern(3);
+        expected.id = p4.id;
+        assert(p4.is_decoded() && p4.content_hash() == expected.content_hash());
+
+        // the decoder leaves alone what was decoded meanwhile
+        PatternDecoder decoder;
+        std::vector<int> encoded_ids;
+        for (const auto &p: loaded.patterns) {
+            if (!p->is_decoded()) {
+                encoded_ids.push_back(p->id);
+            }
+        }
+        decoder.start(loaded);
+        decoder.wait();
+        std::vector<int> adopted_ids;
+        assert(decoder.adopt(loaded, &adopted_ids));
+        std::sort(encoded_ids.begin(), encoded_ids.end());
+        std::sort(adopted_ids.begin(), adopted_ids.end());
+        assert(!encoded_ids.empty() && adopted_ids == encoded_ids);
+        assert(!decoder.adopt(loaded));
+        for (const auto &p: loaded.patterns) {
+            assert(p->is_decoded());
+            if (p->id < 2) {
+                assert(p->to_json_string() == state.get_pattern(p->id).to_json_string());
+            }
+        }
+        assert(loaded.get_pattern(2).get_velocity(V2i(0, 0)) == 1);
+
+        // a decoder that was cancelled hands over nothing
+        auto reloaded = State::from_binary(binary.data(), binary.size());
+        decoder.start(reloaded);
+        decoder.cancel();
+        assert(!decoder.adopt(reloaded));
+        reloaded.decode_all();
+        assert(reloaded.to_binary() == binary && reloaded.to_json_string() == state.to_json_string());
+
+        // version 1 has the cells right after the header and is decoded on load
+        const char v1[] = {'M', 'S', 'Q', 'B', 1, 0, 0, 0, 1,
+                           0, 1, 1, 0, 0, 0, 0, 0, 0, (char) 0x80, 0x3f, 100, 0, 0, 0, 0, 0, 0, 0, 0,
+                           1, 0, 1, 0, 0};
+        const auto old = State::from_binary(v1, sizeof(v1));
+        assert(old.get_pattern(0).is_decoded() && old.get_pattern(0).get_velocity(V2i(0, 0)) == 100);
+        assert(old.get_pattern(0).get_speed() == 1.0f);
     }
 
 }
@@ -14,31 +14,77 @@
 #include <chrono>
 
 #include <optional>
+#include <array>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <limits>
+#include <cstring>
+#include <string_view>
 #include "src/DistrhoDefines.h"
 
 #include "MyAssert.hpp"
 #include "Utils.hpp"
 #include "TimePositionCalc.hpp"
-#include "GenArray.hpp"
+#include "ColumnScan.hpp"
+#include "Cow.hpp"
 
 namespace myseq {
 
 
-    struct Opaque;
-
     void test_serialize();
 
+    void test_column_masks();
+
+    void test_pattern_index();
+
+    void test_copy_on_write();
+
+    void test_lanes();
+
+    void test_content_hash();
+
+    void test_selection();
+
+    void test_binary_state();
+
+    void test_json_reader();
+
+    void test_replace_notes();
+
+    void test_lazy_decoding();
+
     namespace utils {
 
-        static uint8_t midi_note_to_row_index(std::size_t note) {
+        inline uint8_t midi_note_to_row_index(std::size_t note) {
             assert(note >= 0 && note <= 127);
             return 127 - note;
         }
 
-        static uint8_t row_index_to_midi_note(std::size_t row) {
+        inline uint8_t row_index_to_midi_note(std::size_t row) {
             assert(row >= 0 && row <= 127);
             return 127 - row;
         }
+
+        // splitmix64 finalizer
+        inline uint64_t hash_mix(uint64_t h) {
+            h ^= h >> 30;
+            h *= 0xbf58476d1ce4e5b9ull;
+            h ^= h >> 27;
+            h *= 0x94d049bb133111ebull;
+            h ^= h >> 31;
+            return h;
+        }
+
+        inline uint64_t hash_combine(uint64_t seed, uint64_t value) {
+            return hash_mix(seed ^ (value + 0x9e3779b97f4a7c15ull));
+        }
+
+        inline uint64_t float_bits(float f) {
+            uint32_t bits;
+            std::memcpy(&bits, &f, sizeof(bits));
+            return bits;
+        }
     }
 
     template<typename T>
@@ -116,10 +162,176 @@ namespace myseq {
     struct Cell {
         V2i position;
         uint8_t velocity;
-        bool selected;
         int length;
     };
 
+    // A note start as the player sees it
+    struct ScheduledNote {
+        int column;
+        uint8_t note;
+        uint8_t velocity;
+        int length;
+    };
+
+    // A note off the step grid, offset and length are in lane ticks (Pattern::LANE_TICKS_PER_STEP)
+    // from the start of the pattern
+    struct LaneEvent {
+        int offset;
+        uint8_t velocity;
+        int length;
+    };
+
+    // One bit per row of a column, row r is bit r
+    struct RowMask {
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+
+        [[nodiscard]] bool test(int row) const {
+            return ((row < 64 ? lo : hi) >> (row & 63)) & 1;
+        }
+
+        void set(int row) {
+            (row < 64 ? lo : hi) |= uint64_t(1) << (row & 63);
+        }
+
+        void reset(int row) {
+            (row < 64 ? lo : hi) &= ~(uint64_t(1) << (row & 63));
+        }
+
+        [[nodiscard]] bool any() const {
+            return (lo | hi) != 0;
+        }
+
+        [[nodiscard]] int count() const {
+            return __builtin_popcountll(lo) + __builtin_popcountll(hi);
+        }
+
+        // Number of set bits below row
+        [[nodiscard]] int rank(int row) const {
+            const auto lo_below = row >= 64 ? ~uint64_t(0) : (uint64_t(1) << row) - 1;
+            const auto hi_below = row <= 64 ? 0 : (uint64_t(1) << (row - 64)) - 1;
+            return __builtin_popcountll(lo & lo_below) + __builtin_popcountll(hi & hi_below);
+        }
+
+        // Set rows in ascending order
+        template<typename F>
+        void each(F f) const {
+            for (auto w = lo; w != 0; w &= w - 1) {
+                f(__builtin_ctzll(w));
+            }
+            for (auto w = hi; w != 0; w &= w - 1) {
+                f(64 + __builtin_ctzll(w));
+            }
+        }
+    };
+
+    // Selected note starts of a pattern. The UI keeps it next to the pattern rather than in it,
+    // so that selecting changes neither the State nor what is sent to the DSP.
+    // A bit stays set when its note is cleared by other edits, Pattern::each_selected_cell skips those
+    class Selection {
+        std::vector<RowMask> columns;
+        // bit x % 64 of word x / 64 for the columns with anything selected
+        std::vector<uint64_t> selected_columns;
+        int selected_count = 0;
+        V2i box_min;
+        V2i box_max;
+
+        RowMask &column(int x) {
+            if (x >= (int) columns.size()) {
+                columns.resize(x + 1);
+                selected_columns.resize(x / 64 + 1);
+            }
+            return columns[x];
+        }
+
+    public:
+        [[nodiscard]] bool test(const V2i &v) const {
+            return v.x >= 0 && v.x < (int) columns.size() && columns[v.x].test(v.y);
+        }
+
+        void set(const V2i &v) {
+            auto &c = column(v.x);
+            if (c.test(v.y)) {
+                return;
+            }
+            c.set(v.y);
+            selected_columns[v.x / 64] |= uint64_t(1) << (v.x % 64);
+            if (selected_count++ == 0) {
+                box_min = v;
+                box_max = v;
+            } else {
+                box_min = V2i(std::min(box_min.x, v.x), std::min(box_min.y, v.y));
+                box_max = V2i(std::max(box_max.x, v.x), std::max(box_max.y, v.y));
+            }
+        }
+
+        void reset(const V2i &v) {
+            if (!test(v)) {
+                return;
+            }
+            auto &c = columns[v.x];
+            c.reset(v.y);
+            if (!c.any()) {
+                selected_columns[v.x / 64] &= ~(uint64_t(1) << (v.x % 64));
+            }
+            selected_count--;
+        }
+
+        // Selects rows of column x in addition to what is selected already
+        void set_rows(int x, const RowMask &rows) {
+            rows.each([&](int row) {
+                set(V2i(x, row));
+            });
+        }
+
+        // Costs a step per selected column
+        void clear() {
+            each_column([&](int x) {
+                columns[x] = RowMask();
+            });
+            std::fill(selected_columns.begin(), selected_columns.end(), 0);
+            selected_count = 0;
+        }
+
+        [[nodiscard]] int count() const {
+            return selected_count;
+        }
+
+        [[nodiscard]] bool empty() const {
+            return selected_count == 0;
+        }
+
+        // Corners of a box around the selection, only meaningful when it is not empty.
+        // Can be larger than needed after cells were deselected
+        [[nodiscard]] const V2i &get_box_min() const {
+            return box_min;
+        }
+
+        [[nodiscard]] const V2i &get_box_max() const {
+            return box_max;
+        }
+
+        // Columns with anything selected, in ascending order
+        template<typename F>
+        void each_column(F f) const {
+            for (std::size_t k = 0; k < selected_columns.size(); k++) {
+                for (auto w = selected_columns[k]; w != 0; w &= w - 1) {
+                    f(static_cast<int>(k) * 64 + __builtin_ctzll(w));
+                }
+            }
+        }
+
+        // Selected cells by column and then by row
+        template<typename F>
+        void each(F f) const {
+            each_column([&](int x) {
+                columns[x].each([&](int row) {
+                    f(V2i(x, row));
+                });
+            });
+        }
+    };
+
     struct Note {
         uint8_t note;
         uint8_t channel;
@@ -177,53 +389,259 @@ namespace myseq {
     };
 
     class Pattern {
-        GenArray<Cell> cells;
-        std::valarray<Id> grid;
+    public:
+        static constexpr int CHUNK_COLUMNS = 64;
+        static constexpr int MAX_WIDTH = 4096;
+        // Resolution of lane events, 1920 ticks per quarter note in 4/4
+        static constexpr int LANE_TICKS_PER_STEP = 480;
+
+    private:
+        // Rows where a note starts and rows covered by a tied note that started in a column further left
+        struct ColumnMasks {
+            RowMask starts;
+            RowMask tied;
+        };
+
+        // CHUNK_COLUMNS columns and the notes starting in them, so that edits and resizing only
+        // touch the chunks they are in
+        struct Chunk {
+            std::array<ColumnMasks, CHUNK_COLUMNS> columns{};
+            // Note data in column and then row order, the notes starting in column c are
+            // note_begin[c] .. note_begin[c + 1] - 1, in the order of the bits of columns[c].starts
+            std::array<uint16_t, CHUNK_COLUMNS + 1> note_begin{};
+            std::vector<uint8_t> velocities;
+            std::vector<uint16_t> lengths;
+            // bit c for columns with notes starting in them, and every row a note starts in
+            uint64_t columns_with_starts = 0;
+            RowMask rows_with_starts;
+
+            void update_rows_with_starts() {
+                rows_with_starts = RowMask();
+                for (const auto &c: columns) {
+                    rows_with_starts.lo |= c.starts.lo;
+                    rows_with_starts.hi |= c.starts.hi;
+                }
+            }
+        };
+
+        // Owns a chunk, copies of it are deep. Empty for chunks that never had anything in them
+        class ChunkPtr {
+            std::unique_ptr<Chunk> chunk;
+
+        public:
+            ChunkPtr() = default;
+
+            ChunkPtr(ChunkPtr &&) = default;
+
+            ChunkPtr(const ChunkPtr &other) : chunk(other.chunk ? std::make_unique<Chunk>(*other.chunk) : nullptr) {}
+
+            ChunkPtr &operator=(ChunkPtr &&) = default;
+
+            ChunkPtr &operator=(const ChunkPtr &other) {
+                chunk = other.chunk ? std::make_unique<Chunk>(*other.chunk) : nullptr;
+                return *this;
+            }
+
+            [[nodiscard]] Chunk *get() const {
+                return chunk.get();
+            }
+
+            Chunk &get_or_create() {
+                if (!chunk) {
+                    chunk = std::make_unique<Chunk>();
+                }
+                return *chunk;
+            }
+        };
+
+        static inline const ColumnMasks empty_column{};
+
+        std::vector<ChunkPtr> chunks;
+        // Notes off the grid, in row and then offset order, at most one per row and offset.
+        // The lane of row r is lane_events[lane_begin[r]] .. lane_events[lane_begin[r + 1] - 1]
+        std::vector<LaneEvent> lane_events;
+        std::array<int, 129> lane_begin{};
+        RowMask rows_with_lanes;
+        // XOR of item_hash() of every note and lane event. Updated by every change,
+        // so that content_hash() costs the same however many notes there are
+        uint64_t items_hash = 0;
+        // Set while the notes and lane events are still the bytes encoded_cells of the state the pattern
+        // was loaded from, see State::from_binary(). The pattern reads as empty until decoded(),
+        // items_hash is already that of its content
+        std::shared_ptr<const std::string> encoded;
+        std::string_view encoded_cells;
         float speed = 1.0;
         uint8_t default_velocity = 100;
         V2f viewport; // UI view offset in percentage
 
-        [[nodiscard]] V2i index_to_coords(int index) const {
-            assert(index < width * height);
-            const auto x = index / height;
-            const auto y = index % height;
-            return {x, y};
+        enum class HashTag : uint64_t {
+            Note = 1,
+            LaneEvent,
+        };
+
+        static uint64_t item_hash(HashTag tag, int a, int b, uint64_t c) {
+            return utils::hash_combine(utils::hash_combine(utils::hash_combine(static_cast<uint64_t>(tag),
+                                                                               static_cast<uint32_t>(a)),
+                                                           static_cast<uint32_t>(b)), c);
+        }
+
+        // Adds the note starting at x in row to items_hash, or takes it out again
+        void toggle_note_hash(int x, int row) {
+            const auto cell = note_at(x, row);
+            items_hash ^= item_hash(HashTag::Note, x, row,
+                                    (uint64_t(cell.velocity) << 32) | static_cast<uint32_t>(cell.length));
+        }
+
+        void toggle_lane_hash(int row, const LaneEvent &e) {
+            items_hash ^= item_hash(HashTag::LaneEvent, row, e.offset,
+                                    (uint64_t(e.velocity) << 32) | static_cast<uint32_t>(e.length));
+        }
+
+        static int chunk_count(int columns) {
+            return (columns + CHUNK_COLUMNS - 1) / CHUNK_COLUMNS;
         }
 
         [[nodiscard]] bool is_valid_coords(const V2i &v) const {
             return v.x >= 0 && v.x < width && v.y >= 0 && v.y < height;
         }
 
-        [[nodiscard]] int coords_to_index(const V2i &v) const {
-            assert(is_valid_coords(v));
-            return v.x * height + v.y;
+        [[nodiscard]] const Chunk *chunk_of(int x) const {
+            return chunks[x / CHUNK_COLUMNS].get();
         }
 
+        [[nodiscard]] const ColumnMasks &column_masks(int x) const {
+            const auto *chunk = chunk_of(x);
+            return chunk != nullptr ? chunk->columns[x % CHUNK_COLUMNS] : empty_column;
+        }
 
-        Cell &get_cell(const V2i &coords) {
-            return cells.get(grid[coords_to_index(coords)]);
+        ColumnMasks &mutable_column_masks(int x) {
+            return chunks[x / CHUNK_COLUMNS].get_or_create().columns[x % CHUNK_COLUMNS];
         }
 
-        const Cell &get_cell(const V2i &coords) const {
-            return cells.get(grid[coords_to_index(coords)]);
+        // Index of the note starting at x, row in the note data of its chunk
+        [[nodiscard]] int note_index(int x, int row) const {
+            const auto &chunk = *chunk_of(x);
+            const auto c = x % CHUNK_COLUMNS;
+            return chunk.note_begin[c] + chunk.columns[c].starts.rank(row);
         }
 
-        Cell &get_create_if_not_exists(const V2i &coords) {
-            const auto idx = coords_to_index(coords);
-            const auto &cell_id = grid[idx];
-            if (cells.exists(cell_id)) {
-                return cells.get(cell_id);
-            } else {
-                const Cell cell = {coords, get_default_velocity(), false, 1};
-                const auto new_id = cells.push(cell);
-                grid[coords_to_index(coords)] = new_id;
-                return cells.get(new_id);
+        // Column where the note covering v starts, -1 if v is empty. Chunks without a note
+        // starting in the row are skipped, a long note costs a walk over its first and last chunk
+        [[nodiscard]] int start_column(const V2i &v) const {
+            if (!exists(v)) {
+                return -1;
+            }
+            auto x = v.x;
+            while (true) {
+                const auto &chunk = *chunk_of(x);
+                if (chunk.rows_with_starts.test(v.y)) {
+                    const auto chunk_begin = x - x % CHUNK_COLUMNS;
+                    for (; x >= chunk_begin; x--) {
+                        if (chunk.columns[x % CHUNK_COLUMNS].starts.test(v.y)) {
+                            return x;
+                        }
+                    }
+                } else {
+                    x -= x % CHUNK_COLUMNS + 1;
+                }
+                assert(x >= 0);
+            }
+        }
+
+        void insert_note(const V2i &v, uint8_t velocity) {
+            auto &chunk = chunks[v.x / CHUNK_COLUMNS].get_or_create();
+            const auto c = v.x % CHUNK_COLUMNS;
+            const auto index = note_index(v.x, v.y);
+            chunk.velocities.insert(chunk.velocities.begin() + index, velocity);
+            chunk.lengths.insert(chunk.lengths.begin() + index, 1);
+            for (int i = c + 1; i <= CHUNK_COLUMNS; i++) {
+                chunk.note_begin[i]++;
+            }
+            chunk.columns[c].starts.set(v.y);
+            chunk.columns_with_starts |= uint64_t(1) << c;
+            chunk.rows_with_starts.set(v.y);
+            toggle_note_hash(v.x, v.y);
+        }
+
+        void erase_note(const V2i &v) {
+            toggle_note_hash(v.x, v.y);
+            auto &chunk = *chunks[v.x / CHUNK_COLUMNS].get();
+            const auto c = v.x % CHUNK_COLUMNS;
+            const auto index = note_index(v.x, v.y);
+            chunk.velocities.erase(chunk.velocities.begin() + index);
+            chunk.lengths.erase(chunk.lengths.begin() + index);
+            for (int i = c + 1; i <= CHUNK_COLUMNS; i++) {
+                chunk.note_begin[i]--;
+            }
+            auto &masks = chunk.columns[c];
+            masks.starts.reset(v.y);
+            if (!masks.starts.any()) {
+                chunk.columns_with_starts &= ~(uint64_t(1) << c);
+            }
+            chunk.update_rows_with_starts();
+        }
+
+        // Adds a note that comes after all notes in column and then row order, to cells that no note covers
+        void append_note(const V2i &v, uint8_t velocity, int length) {
+            auto &chunk = chunks[v.x / CHUNK_COLUMNS].get_or_create();
+            const auto c = v.x % CHUNK_COLUMNS;
+            chunk.velocities.push_back(velocity);
+            chunk.lengths.push_back(static_cast<uint16_t>(length));
+            // the columns after c are empty
+            std::fill(chunk.note_begin.begin() + c + 1, chunk.note_begin.end(),
+                      static_cast<uint16_t>(chunk.velocities.size()));
+            chunk.columns[c].starts.set(v.y);
+            chunk.columns_with_starts |= uint64_t(1) << c;
+            chunk.rows_with_starts.set(v.y);
+            for (int x = v.x + 1; x < v.x + length; x++) {
+                mutable_column_masks(x).tied.set(v.y);
+            }
+            toggle_note_hash(v.x, v.y);
+        }
+
+        // Adds a lane event that comes after all lane events in row and then offset order
+        void append_lane_event(int row, const LaneEvent &event) {
+            lane_events.push_back(event);
+            std::fill(lane_begin.begin() + row + 1, lane_begin.end(), static_cast<int>(lane_events.size()));
+            rows_with_lanes.set(row);
+            toggle_lane_hash(row, event);
+        }
+
+        [[nodiscard]] Cell note_at(int x, int row) const {
+            const auto &chunk = *chunk_of(x);
+            const auto index = note_index(x, row);
+            return {V2i(x, row), chunk.velocities[index], chunk.lengths[index]};
+        }
+
+        // Index of the first event of the lane of row at or after offset
+        [[nodiscard]] int lane_lower_bound(int row, int offset) const {
+            const auto begin = lane_events.begin() + lane_begin[row];
+            const auto end = lane_events.begin() + lane_begin[row + 1];
+            return static_cast<int>(std::lower_bound(begin, end, offset, [](const LaneEvent &e, int o) {
+                return e.offset < o;
+            }) - lane_events.begin());
+        }
+
+        // Erases lane_events[from] .. lane_events[to - 1], which need to be in the lane of row
+        void erase_lane_events(int row, int from, int to) {
+            for (auto i = from; i < to; i++) {
+                toggle_lane_hash(row, lane_events[i]);
+            }
+            lane_events.erase(lane_events.begin() + from, lane_events.begin() + to);
+            for (int r = row + 1; r <= 128; r++) {
+                lane_begin[r] -= to - from;
+            }
+            if (lane_begin[row] == lane_begin[row + 1]) {
+                rows_with_lanes.reset(row);
             }
         }
 
     private:
         int first_note;
         int last_note;
+
+        friend class PatternBuilder;
+        friend class PatternCodec;
     public:
         int id;
         int width;
@@ -231,7 +649,7 @@ namespace myseq {
         V2i cursor;
 
         explicit Pattern(int id) : id(id), width(32), height(128), first_note(0), last_note(127) {
-            grid.resize(width * height);
+            chunks.resize(chunk_count(width));
         }
 
         Pattern(int id, int width, int height, int first_note, int last_note, const V2i &cursor) : id(id), width(width),
@@ -240,89 +658,414 @@ namespace myseq {
                                                                                                            first_note),
                                                                                                    last_note(last_note),
                                                                                                    cursor(cursor) {
-            grid.resize(width * height);
+            assert(height <= 128);
+            assert(width <= MAX_WIDTH);
+            chunks.resize(chunk_count(width));
         }
 
+        // Cells are visited by column and then by row. The callback may clear or deselect cells,
+        // cells that it clears before they are reached are skipped
         template<typename F>
         void each_cell(F f) const {
-            for (const auto &c: cells) {
-                f(c);
+            for (std::size_t k = 0; k < chunks.size(); k++) {
+                const auto *chunk = chunks[k].get();
+                if (chunk == nullptr) {
+                    continue;
+                }
+                for (auto w = chunk->columns_with_starts; w != 0; w &= w - 1) {
+                    const auto c = __builtin_ctzll(w);
+                    const auto x = static_cast<int>(k) * CHUNK_COLUMNS + c;
+                    const auto starts = chunk->columns[c].starts;
+                    starts.each([&](int row) {
+                        if (chunk->columns[c].starts.test(row)) {
+                            f(note_at(x, row));
+                        }
+                    });
+                }
+            }
+        }
+
+        // Notes starting in selected cells by column and then by row, costs a step per selected cell.
+        // The callback may clear cells
+        template<typename F>
+        void each_selected_cell(const Selection &selection, F f) const {
+            selection.each([&](const V2i &v) {
+                if (v.x < width && column_masks(v.x).starts.test(v.y)) {
+                    f(note_at(v.x, v.y));
+                }
+            });
+        }
+
+        // Writes the notes with velocity above 0 that start in column to out, highest note first,
+        // and returns how many there are. out needs room for height notes
+        int collect_note_starts(int column, ScheduledNote *out, NonzeroMaskFn mask = nonzero_mask) const {
+            const auto *chunk = chunk_of(column);
+            if (chunk == nullptr) {
+                return 0;
+            }
+            const auto c = column % CHUNK_COLUMNS;
+            const auto begin = chunk->note_begin[c];
+            uint64_t playable[2];
+            mask(chunk->velocities.data() + begin, static_cast<std::size_t>(chunk->note_begin[c + 1] - begin),
+                 playable);
+            int count = 0;
+            int i = 0;
+            chunk->columns[c].starts.each([&](int row) {
+                const auto index = begin + i;
+                out[count] = {column, utils::row_index_to_midi_note(row), chunk->velocities[index],
+                              chunk->lengths[index]};
+                count += static_cast<int>((playable[i >> 6] >> (i & 63)) & 1);
+                i++;
+            });
+            return count;
+        }
+
+        // Notes with velocity above 0 starting in column, highest note first
+        template<typename F>
+        void each_note_in_column(int column, F f) const {
+            std::array<ScheduledNote, 128> notes;
+            const auto count = collect_note_starts(column, notes.data());
+            for (int i = 0; i < count; i++) {
+                f(notes[i]);
+            }
+        }
+
+        [[nodiscard]] bool has_notes_in_column(int column) const {
+            return column_masks(column).starts.any();
+        }
+
+        // First column from `from` on with notes starting in it, -1 if there is none before the end.
+        // Skips empty chunks, so the cost does not grow with the width of a sparse pattern
+        [[nodiscard]] int next_column_with_notes(int from) const {
+            for (auto k = from / CHUNK_COLUMNS; k < static_cast<int>(chunks.size()); k++) {
+                const auto *chunk = chunks[k].get();
+                if (chunk == nullptr) {
+                    continue;
+                }
+                auto w = chunk->columns_with_starts;
+                if (k == from / CHUNK_COLUMNS) {
+                    w &= ~uint64_t(0) << (from % CHUNK_COLUMNS);
+                }
+                if (w != 0) {
+                    return k * CHUNK_COLUMNS + __builtin_ctzll(w);
+                }
+            }
+            return -1;
+        }
+
+        // Length of the pattern in lane ticks, lane events start before this
+        [[nodiscard]] int lane_ticks() const {
+            return width * LANE_TICKS_PER_STEP;
+        }
+
+        // Adds a lane event to row, replacing the one at the same offset. Does not allocate
+        // while there is room left from reserve_cells()
+        void set_lane_event(int row, const LaneEvent &event) {
+            assert(row >= 0 && row < height);
+            assert(event.offset >= 0 && event.offset < lane_ticks() && event.length >= 1);
+            const auto index = lane_lower_bound(row, event.offset);
+            toggle_lane_hash(row, event);
+            if (index < lane_begin[row + 1] && lane_events[index].offset == event.offset) {
+                toggle_lane_hash(row, lane_events[index]);
+                lane_events[index] = event;
+                return;
+            }
+            lane_events.insert(lane_events.begin() + index, event);
+            for (int r = row + 1; r <= 128; r++) {
+                lane_begin[r]++;
+            }
+            rows_with_lanes.set(row);
+        }
+
+        void clear_lane_event(int row, int offset) {
+            assert(row >= 0 && row < height);
+            const auto index = lane_lower_bound(row, offset);
+            if (index < lane_begin[row + 1] && lane_events[index].offset == offset) {
+                erase_lane_events(row, index, index + 1);
             }
         }
 
+        [[nodiscard]] std::optional<LaneEvent> get_lane_event(int row, int offset) const {
+            const auto index = lane_lower_bound(row, offset);
+            if (index < lane_begin[row + 1] && lane_events[index].offset == offset) {
+                return lane_events[index];
+            }
+            return {};
+        }
+
+        [[nodiscard]] bool has_lane_events() const {
+            return rows_with_lanes.any();
+        }
+
+        // All lane events by row and then by offset, f(int row, const LaneEvent &)
         template<typename F>
-        void each_selected_cell(F f) const {
-            each_cell([&f](const Cell &cell) {
-                if (cell.selected) {
-                    f(cell);
+        void each_lane_event(F f) const {
+            rows_with_lanes.each([&](int row) {
+                for (auto i = lane_begin[row]; i < lane_begin[row + 1]; i++) {
+                    f(row, lane_events[i]);
                 }
             });
         }
 
+        // Lane events with from <= offset < to, f(int row, const LaneEvent &) by row and then by offset.
+        // Costs a binary search per row that has a lane
+        template<typename F>
+        void each_lane_event_between(int from, int to, F f) const {
+            rows_with_lanes.each([&](int row) {
+                for (auto i = lane_lower_bound(row, from); i < lane_begin[row + 1] && lane_events[i].offset < to; i++) {
+                    f(row, lane_events[i]);
+                }
+            });
+        }
+
+        // Smallest lane event offset from `from` on, -1 if there is none before the end
+        [[nodiscard]] int next_lane_offset(int from) const {
+            int next = -1;
+            rows_with_lanes.each([&](int row) {
+                const auto i = lane_lower_bound(row, from);
+                if (i < lane_begin[row + 1] && (next < 0 || lane_events[i].offset < next)) {
+                    next = lane_events[i].offset;
+                }
+            });
+            return next;
+        }
+
         [[nodiscard]] bool exists(const V2i &coords) const {
             if (!is_valid_coords(coords)) {
                 return false;
             }
-            return cells.exists(grid[coords_to_index(coords)]);
+            const auto &c = column_masks(coords.x);
+            return c.starts.test(coords.y) | c.tied.test(coords.y);
         }
 
         void set_cell(const Cell &c) {
-            get_create_if_not_exists(c.position);
+            set_active(c.position, true);
             set_length(c.position, c.length);
-            set_selected(c.position, c.length);
             set_velocity(c.position, c.velocity);
         }
 
-        [[nodiscard]] const Cell &get_cell_const_ref(const V2i &coords) const {
-            return cells.get(grid[coords_to_index(coords)]);
+        // The note covering coords, which needs to exist
+        [[nodiscard]] Cell get_cell(const V2i &coords) const {
+            const auto x = start_column(coords);
+            assert(x >= 0);
+            return note_at(x, coords.y);
         }
 
         void clear_cell(const V2i &coords) {
-            if (exists(coords)) {
-                const auto cell_id = grid[coords_to_index(coords)];
-                set_length(coords, 1);
-                cells.remove(cell_id);
+            const auto x = start_column(coords);
+            if (x >= 0) {
+                const auto start = V2i(x, coords.y);
+                set_length(start, 1);
+                erase_note(start);
             }
         }
 
-        void put_cells(const std::vector<Cell> &cells, const V2i &at) {
-            for (auto cell: cells) {
-                auto wrapped = cell.position + at;
-                wrapped.x = wrapped.x % width;
-                wrapped.x += wrapped.x < 0 ? width : 0;
-                wrapped.y = wrapped.y % height;
-                wrapped.y += wrapped.y < 0 ? height : 0;
-                cell.position = wrapped;
-                set_cell(cell);
+        // Clears the notes covering `erase` and puts `notes` in, in one pass over the chunks this touches
+        // rather than note by note. Notes outside the grid are dropped, of notes with the same start the last
+        // one stays, and notes are cut at the right edge and where the next note of their row starts.
+        // They replace the notes that start under them and cut short the notes they start under.
+        // Returns the notes as they were put, by column and then row
+        std::vector<Cell> replace_notes(const std::vector<V2i> &erase, std::vector<Cell> notes) {
+            notes.erase(std::remove_if(notes.begin(), notes.end(), [&](const Cell &c) {
+                return !is_valid_coords(c.position);
+            }), notes.end());
+            std::stable_sort(notes.begin(), notes.end(), [](const Cell &a, const Cell &b) {
+                return a.position.x != b.position.x ? a.position.x < b.position.x : a.position.y < b.position.y;
+            });
+            std::size_t n = 0;
+            for (const auto &c: notes) {
+                if (n > 0 && notes[n - 1].position == c.position) {
+                    notes[n - 1] = c;
+                } else {
+                    notes[n++] = c;
+                }
+            }
+            notes.resize(n);
+            // column of the next note of every row, from the right
+            std::array<int, 128> next_start;
+            next_start.fill(width);
+            for (auto it = notes.rbegin(); it != notes.rend(); ++it) {
+                it->length = std::clamp(it->length, 1, next_start[it->position.y] - it->position.x);
+                next_start[it->position.y] = it->position.x;
+            }
+
+            std::vector<V2i> erase_starts;
+            for (const auto &v: erase) {
+                const auto x = start_column(v);
+                if (x >= 0) {
+                    erase_starts.emplace_back(x, v.y);
+                }
+            }
+            // only columns from first_column to last_column change
+            auto first_column = width;
+            auto last_column = -1;
+            for (const auto &c: notes) {
+                first_column = std::min(first_column, c.position.x);
+                last_column = std::max(last_column, c.position.x + c.length - 1);
+            }
+            for (const auto &v: erase_starts) {
+                first_column = std::min(first_column, v.x);
+                last_column = std::max(last_column, v.x);
+            }
+            if (last_column < 0) {
+                return notes;
+            }
+
+            // rows where notes start that go, of every column from first_column on
+            std::vector<RowMask> drop(last_column - first_column + 1);
+            for (const auto &c: notes) {
+                for (int x = c.position.x; x < c.position.x + c.length; x++) {
+                    drop[x - first_column].set(c.position.y);
+                }
+            }
+            for (const auto &v: erase_starts) {
+                drop[v.x - first_column].set(v.y);
+            }
+            auto dropped = [&](int x) {
+                return x >= first_column && x <= last_column ? drop[x - first_column] : RowMask();
+            };
+            // the ties of notes that go may reach past the notes that replace them
+            for (int x = next_column_with_notes(first_column); x >= 0 && x <= last_column;
+                 x = next_column_with_notes(x + 1)) {
+                const auto &starts = column_masks(x).starts;
+                const RowMask going{starts.lo & dropped(x).lo, starts.hi & dropped(x).hi};
+                going.each([&](int row) {
+                    const auto length = note_at(x, row).length;
+                    toggle_note_hash(x, row);
+                    for (int t = x + 1; t < x + length; t++) {
+                        mutable_column_masks(t).tied.reset(row);
+                    }
+                });
             }
+            for (const auto &c: notes) {
+                if (column_masks(c.position.x).tied.test(c.position.y)) {
+                    const auto x = start_column(c.position);
+                    set_length(V2i(x, c.position.y), c.position.x - x);
+                }
+            }
+
+            auto next = notes.begin();
+            for (int k = first_column / CHUNK_COLUMNS; k <= last_column / CHUNK_COLUMNS; k++) {
+                const auto first = k * CHUNK_COLUMNS;
+                const auto last = std::min(width, first + CHUNK_COLUMNS);
+                bool changes = false;
+                for (int x = std::max(first, first_column); x < std::min(last, last_column + 1); x++) {
+                    changes |= dropped(x).any();
+                }
+                if (!changes) {
+                    continue;
+                }
+                auto &chunk = chunks[k].get_or_create();
+                std::size_t count = 0;
+                for (int x = first; x < last; x++) {
+                    const auto &starts = chunk.columns[x - first].starts;
+                    count += RowMask{starts.lo & ~dropped(x).lo, starts.hi & ~dropped(x).hi}.count();
+                }
+                auto column_end = next;
+                while (column_end != notes.end() && column_end->position.x < last) {
+                    column_end++;
+                }
+                count += column_end - next;
+
+                // the notes that stay and the new ones, in column and then row order
+                std::vector<uint8_t> velocities;
+                std::vector<uint16_t> lengths;
+                velocities.reserve(std::max(count, chunk.velocities.capacity()));
+                lengths.reserve(std::max(count, chunk.lengths.capacity()));
+                chunk.columns_with_starts = 0;
+                for (int c = 0; c < CHUNK_COLUMNS; c++) {
+                    const auto x = first + c;
+                    auto &masks = chunk.columns[c];
+                    const auto old_begin = chunk.note_begin[c];
+                    const auto old_starts = masks.starts;
+                    chunk.note_begin[c] = static_cast<uint16_t>(velocities.size());
+                    if (x >= last) {
+                        continue;
+                    }
+                    RowMask starts{old_starts.lo & ~dropped(x).lo, old_starts.hi & ~dropped(x).hi};
+                    auto added = next;
+                    while (added != column_end && added->position.x == x) {
+                        starts.set(added->position.y);
+                        added++;
+                    }
+                    starts.each([&](int row) {
+                        if (next != added && next->position.y == row) {
+                            velocities.push_back(next->velocity);
+                            lengths.push_back(static_cast<uint16_t>(next->length));
+                            next++;
+                        } else {
+                            const auto index = old_begin + old_starts.rank(row);
+                            velocities.push_back(chunk.velocities[index]);
+                            lengths.push_back(chunk.lengths[index]);
+                        }
+                    });
+                    masks.starts = starts;
+                    if (starts.any()) {
+                        chunk.columns_with_starts |= uint64_t(1) << c;
+                    }
+                }
+                chunk.note_begin[CHUNK_COLUMNS] = static_cast<uint16_t>(velocities.size());
+                chunk.velocities = std::move(velocities);
+                chunk.lengths = std::move(lengths);
+                chunk.update_rows_with_starts();
+            }
+
+            for (const auto &c: notes) {
+                for (int x = c.position.x + 1; x < c.position.x + c.length; x++) {
+                    mutable_column_masks(x).tied.set(c.position.y);
+                }
+                toggle_note_hash(c.position.x, c.position.y);
+            }
+            return notes;
         }
 
-        void move_selected_cells(const V2i &delta) {
-            std::vector<Cell> removed;
-            each_selected_cell([&](const Cell &cell) {
-                removed.emplace_back(cell);
-                clear_cell(cell.position);
-            });
-            put_cells(removed, delta);
+        // v moved into the grid across the edges
+        [[nodiscard]] V2i wrap(const V2i &v) const {
+            return {(v.x % width + width) % width, (v.y % height + height) % height};
         }
 
-        int deselect_all() {
-            int count = 0;
-            for (auto &c: cells) {
-                if (c.selected) {
-                    c.selected = false;
-                    count++;
-                }
+        // Puts cells at an offset, wrapping around the edges, and selects them
+        void put_cells(const std::vector<Cell> &cells, const V2i &at, Selection &selection) {
+            std::vector<Cell> wrapped_cells = cells;
+            for (auto &cell: wrapped_cells) {
+                cell.position = wrap(cell.position + at);
+            }
+            for (const auto &cell: replace_notes({}, std::move(wrapped_cells))) {
+                selection.set(cell.position);
+            }
+        }
 
+        // Costs a step per selected cell and one per note in the chunks the cells leave or land in,
+        // the moved cells stay selected
+        void move_selected_cells(Selection &selection, const V2i &delta) {
+            std::vector<V2i> erase;
+            std::vector<Cell> moved;
+            each_selected_cell(selection, [&](const Cell &cell) {
+                erase.push_back(cell.position);
+                moved.push_back(cell);
+            });
+            selection.clear();
+            for (auto &cell: moved) {
+                cell.position = wrap(cell.position + delta);
+            }
+            for (const auto &cell: replace_notes(erase, std::move(moved))) {
+                selection.set(cell.position);
             }
-            return count;
         }
 
         void set_velocity(const V2i &v, uint8_t velocity, const char *caller_name = nullptr) {
             if (caller_name != nullptr) {
                 // d_debug("set_velocity %d %d %d %s", v.x, v.y, velocity, caller_name);
             }
-            get_create_if_not_exists(v).velocity = velocity;
+            const auto x = start_column(v);
+            if (x >= 0) {
+                toggle_note_hash(x, v.y);
+                chunks[x / CHUNK_COLUMNS].get()->velocities[note_index(x, v.y)] = velocity;
+                toggle_note_hash(x, v.y);
+            } else {
+                assert(is_valid_coords(v));
+                insert_note(v, velocity);
+            }
         }
 
         [[nodiscard]] bool is_active(const V2i &v) const {
@@ -345,10 +1088,19 @@ namespace myseq {
             this->default_velocity = new_default_velocity;
         }
 
-        void select_row() {
-            deselect_all();
-            for (int x = 0; x < width; x++) {
-                set_selected(V2i(x, cursor.y), true);
+        // Selects the notes in the row of the cursor instead of what was selected
+        void select_row(Selection &selection) const {
+            selection.clear();
+            for (std::size_t k = 0; k < chunks.size(); k++) {
+                const auto *chunk = chunks[k].get();
+                if (chunk != nullptr && chunk->rows_with_starts.test(cursor.y)) {
+                    for (auto w = chunk->columns_with_starts; w != 0; w &= w - 1) {
+                        const auto c = __builtin_ctzll(w);
+                        if (chunk->columns[c].starts.test(cursor.y)) {
+                            selection.set(V2i(static_cast<int>(k) * CHUNK_COLUMNS + c, cursor.y));
+                        }
+                    }
+                }
             }
         }
 
@@ -362,106 +1114,135 @@ namespace myseq {
 
         void set_active(const V2i &v, bool active) {
             if (active) {
-                get_create_if_not_exists(v);
+                if (!exists(v)) {
+                    assert(is_valid_coords(v));
+                    insert_note(v, get_default_velocity());
+                }
             } else {
                 clear_cell(v);
             }
         }
 
         [[nodiscard]] uint8_t get_velocity(const V2i &v) const {
-            if (exists(v)) {
-                return get_cell(v).velocity;
-            } else {
-                return 0;
-            }
+            const auto x = start_column(v);
+            return x >= 0 ? chunk_of(x)->velocities[note_index(x, v.y)] : 0;
         }
 
         [[nodiscard]] bool is_extension_of_tied(const V2i &v) const {
-            return exists(v) && get_cell(v).position != v;
+            return is_valid_coords(v) && column_masks(v.x).tied.test(v.y);
         }
 
-        void set_selected(const V2i &v, bool selected) {
-
-            if (exists(v)) {
-                get_cell(v).selected = selected;
+        // Selects or deselects the note covering v, if there is one
+        void set_selected(Selection &selection, const V2i &v, bool selected) const {
+            const auto x = start_column(v);
+            if (x >= 0) {
+                if (selected) {
+                    selection.set(V2i(x, v.y));
+                } else {
+                    selection.reset(V2i(x, v.y));
+                }
             }
         }
 
         void set_length(const V2i &v, int length) {
             assert(length >= 1);
-            if (exists(v)) {
-                Cell &cell = get_cell(v);
-                const auto &p = cell.position;
-                assert(p.x + length - 1 < this->width);
-                while (cell.length > length) {
-                    const auto index = coords_to_index(V2i(p.x + cell.length - 1, p.y));
-                    grid[index] = Id::null();
-                    cell.length--;
+            const auto x = start_column(v);
+            if (x >= 0) {
+                const auto row = v.y;
+                assert(x + length - 1 < this->width);
+                auto &lengths = chunks[x / CHUNK_COLUMNS].get()->lengths;
+                auto current = static_cast<int>(lengths[note_index(x, row)]);
+                toggle_note_hash(x, row);
+                while (current > length) {
+                    mutable_column_masks(x + current - 1).tied.reset(row);
+                    current--;
                 }
-                const auto cell_id = grid[coords_to_index(p)];
-                while (cell.length < length) {
-                    cell.length++;
-                    const auto coords = V2i(p.x + cell.length - 1, p.y);
-                    clear_cell(coords);
-                    grid[coords_to_index(coords)] = cell_id;
+                while (current < length) {
+                    // notes further right do not move this note's index
+                    clear_cell(V2i(x + current, row));
+                    mutable_column_masks(x + current).tied.set(row);
+                    current++;
                 }
+                lengths[note_index(x, row)] = static_cast<uint16_t>(current);
+                toggle_note_hash(x, row);
             }
         }
 
-        void select_all() {
-            for (auto &c: cells)
-                c.selected = true;
-        }
-
-        [[nodiscard]] int num_selected() const {
-            int count = 0;
-            for (const auto &c: cells) {
-                if (c.selected) count++;
+        // Selects every note, costs a step per column with notes
+        void select_all(Selection &selection) const {
+            for (std::size_t k = 0; k < chunks.size(); k++) {
+                const auto *chunk = chunks[k].get();
+                if (chunk == nullptr) {
+                    continue;
+                }
+                for (auto w = chunk->columns_with_starts; w != 0; w &= w - 1) {
+                    const auto c = __builtin_ctzll(w);
+                    selection.set_rows(static_cast<int>(k) * CHUNK_COLUMNS + c, chunk->columns[c].starts);
+                }
             }
-            return count;
         }
 
-        [[nodiscard]] bool get_selected(const V2i &v) const {
-            if (exists(v)) {
-                return get_cell(v).selected;
-            } else {
+        // Whether the note covering v is selected
+        [[nodiscard]] bool get_selected(const Selection &selection, const V2i &v) const {
+            if (selection.empty() || v.x < selection.get_box_min().x || v.y < selection.get_box_min().y
+                || v.y > selection.get_box_max().y) {
                 return false;
             }
+            const auto x = start_column(v);
+            return x >= 0 && selection.test(V2i(x, v.y));
         }
 
         [[nodiscard]] int get_length(const V2i &v) const {
-            if (exists(v)) {
-                return get_cell(v).length;
-            } else {
-                return 0;
-            }
+            const auto x = start_column(v);
+            return x >= 0 ? chunk_of(x)->lengths[note_index(x, v.y)] : 0;
         }
 
+        // Only touches the chunks at and past the smaller of the widths,
+        // and the notes that reach over the new end
         void resize_width(int new_width) {
-            auto new_grid = std::valarray<Id>(new_width * height);
-            const auto n = std::min(new_grid.size(), grid.size());
-
+            assert(new_width >= 1 && new_width <= MAX_WIDTH);
             if (new_width < width) {
-                for (auto it = cells.begin(); it != cells.end();) {
-                    auto &cell = *it;
-                    const int new_length = std::min(new_width - cell.position.x, cell.length);
-                    if (new_length > 0) {
-                        if (new_length < cell.length) {
-                            set_length(cell.position, new_length);
-                        }
-                        ++it;
-                    } else {
-                        it = cells.erase(it);
+                // notes starting before the new end are cut there
+                const auto crossing = column_masks(new_width).tied;
+                crossing.each([&](int row) {
+                    const auto x = start_column(V2i(new_width, row));
+                    set_length(V2i(x, row), new_width - x);
+                });
+                for (auto x = next_column_with_notes(new_width); x >= 0; x = next_column_with_notes(x + 1)) {
+                    column_masks(x).starts.each([&](int row) {
+                        toggle_note_hash(x, row);
+                    });
+                }
+                const auto c = new_width % CHUNK_COLUMNS;
+                auto *chunk = chunks[new_width / CHUNK_COLUMNS].get();
+                if (c > 0 && chunk != nullptr) {
+                    for (auto i = c; i < CHUNK_COLUMNS; i++) {
+                        chunk->columns[i] = ColumnMasks();
+                        chunk->note_begin[i + 1] = chunk->note_begin[c];
                     }
-                };
+                    chunk->velocities.resize(chunk->note_begin[c]);
+                    chunk->lengths.resize(chunk->note_begin[c]);
+                    chunk->columns_with_starts &= (uint64_t(1) << c) - 1;
+                    chunk->update_rows_with_starts();
+                }
             }
+            chunks.resize(chunk_count(new_width));
+            width = new_width;
+            // lane events past the new end are dropped
+            rows_with_lanes.each([&](int row) {
+                erase_lane_events(row, lane_lower_bound(row, lane_ticks()), lane_begin[row + 1]);
+            });
+        }
 
-            for (std::size_t i = 0; i < n; i++) {
-                new_grid[i] = grid[i];
+        // Leaves room for `extra` new cells in every chunk and `extra` new lane events,
+        // so that editing this pattern does not allocate until that many were added
+        void reserve_cells(std::size_t extra) {
+            for (auto &chunk: chunks) {
+                auto &c = chunk.get_or_create();
+                c.velocities.reserve(c.velocities.size() + extra);
+                c.lengths.reserve(c.lengths.size() + extra);
             }
-
-            grid = new_grid;
-            width = new_width;
+            lane_events.reserve(lane_events.size() + extra);
         }
 
 
@@ -469,6 +1250,30 @@ namespace myseq {
             return last_note;
         }
 
+        [[nodiscard]] bool is_decoded() const {
+            return encoded == nullptr;
+        }
+
+        // The pattern with its notes and lane events decoded, a copy when it already is.
+        // Only reads the pattern, so it can run on a thread that holds a copy of its Cow
+        [[nodiscard]] Pattern decoded() const;
+
+        // The pattern as it appears in the "patterns" array of the state JSON
+        [[nodiscard]] std::string to_json_string() const;
+
+        // Hash of everything that is saved with the pattern, equal for patterns with the same content
+        // however they were edited. Constant time
+        [[nodiscard]] uint64_t content_hash() const {
+            uint64_t h = items_hash;
+            for (const uint64_t v: {(uint64_t) id, (uint64_t) width, (uint64_t) height, (uint64_t) first_note,
+                                    (uint64_t) last_note, utils::float_bits(speed), (uint64_t) default_velocity,
+                                    (uint64_t) cursor.x, (uint64_t) cursor.y, utils::float_bits(viewport.x),
+                                    utils::float_bits(viewport.y)}) {
+                h = utils::hash_combine(h, v);
+            }
+            return h;
+        }
+
         [[nodiscard]] int get_id() const {
             return id;
         }
@@ -492,25 +1297,127 @@ namespace myseq {
         }
 
         void move_cursor_to_lowest_note() {
-            int lowest = 127;
-            for (const auto &c: cells) {
-                const auto note = utils::row_index_to_midi_note(c.position.y);
-                if (note < lowest) {
-                    lowest = note;
+            int lowest_row = 0;
+            for (const auto &chunk: chunks) {
+                if (chunk.get() != nullptr) {
+                    chunk.get()->rows_with_starts.each([&](int row) {
+                        lowest_row = std::max(lowest_row, row);
+                    });
                 }
             }
             cursor.x = 0;
-            cursor.y = utils::midi_note_to_row_index(lowest);
+            cursor.y = lowest_row;
         }
     };
 
-    struct Opaque;
+    // Fills an empty pattern with notes and lane events in whatever order a loader reads them.
+    // While they come in the order the pattern keeps them, by column and then row and lane events
+    // by row and then offset, they are appended without any lookups. From the first note that comes
+    // out of order or starts under an earlier one on, notes are kept and put in with one
+    // Pattern::replace_notes() by build()
+    class PatternBuilder {
+        Pattern pattern;
+        bool notes_in_order = true;
+        std::vector<Cell> unordered;
+        V2i last_note = V2i(-1, 0);
+        // column after the last note of every row
+        std::array<int, 128> row_end{};
+        int last_lane_row = -1;
+        int last_lane_offset = -1;
+
+    public:
+        explicit PatternBuilder(Pattern pattern) : pattern(std::move(pattern)) {
+            assert(this->pattern.next_column_with_notes(0) < 0 && !this->pattern.has_lane_events());
+        }
+
+        void add_note(const V2i &v, uint8_t velocity, int length) {
+            if (notes_in_order && (v.x > last_note.x || (v.x == last_note.x && v.y > last_note.y))
+                && pattern.is_valid_coords(v) && v.x >= row_end[v.y]) {
+                assert(length >= 1 && v.x + length <= pattern.width);
+                pattern.append_note(v, velocity, length);
+                last_note = v;
+                row_end[v.y] = v.x + length;
+            } else {
+                notes_in_order = false;
+                unordered.push_back({v, velocity, length});
+            }
+        }
+
+        // Lane events out of order go through set_lane_event(), which keeps the order appending relies on
+        void add_lane_event(int row, const LaneEvent &event) {
+            if (row > last_lane_row || (row == last_lane_row && event.offset > last_lane_offset)) {
+                assert(row < pattern.height && event.offset >= 0 && event.offset < pattern.lane_ticks()
+                       && event.length >= 1);
+                pattern.append_lane_event(row, event);
+                last_lane_row = row;
+                last_lane_offset = event.offset;
+            } else {
+                pattern.set_lane_event(row, event);
+            }
+        }
+
+        Pattern build() {
+            if (!unordered.empty()) {
+                pattern.replace_notes({}, std::move(unordered));
+                unordered.clear();
+            }
+            return std::move(pattern);
+        }
+    };
+
+    // A pattern started by a trigger note, with the note's position within the pattern's
+    // trigger range precomputed as a fraction of the pattern length
+    struct TriggerTarget {
+        int pattern_id;
+        float start_offset;
+        int width;
+    };
 
     struct State {
     private:
         int selected = -1;
+        // pattern id -> index into patterns, -1 for unused ids.
+        // Ids are handed out as max + 1, so the table stays dense
+        std::vector<int> id_to_index;
+        // trigger note -> patterns it starts, targets of note n are
+        // trigger_targets[trigger_begin[n]] .. trigger_targets[trigger_begin[n + 1] - 1]
+        std::vector<TriggerTarget> trigger_targets;
+        std::array<int, 129> trigger_begin{};
+
+        // Returns false when the id is taken already, the first pattern with it stays indexed
+        bool index_pattern(int index) {
+            const auto id = patterns[index]->id;
+            assert(id >= 0 && id < MAX_PATTERN_ID);
+            if (id >= (int) id_to_index.size()) {
+                id_to_index.resize(id + 1, -1);
+            }
+            if (id_to_index[id] >= 0) {
+                return false;
+            }
+            id_to_index[id] = index;
+            return true;
+        }
+
+        void decode(std::size_t index) {
+            auto &cow = patterns[index];
+            if (!cow->is_decoded()) {
+                cow = Cow<Pattern>(cow->decoded());
+            }
+        }
+
+        Pattern &mutate_pattern(std::size_t index) {
+            decode(index);
+            return patterns[index].mutate();
+        }
+
     public:
-        std::vector<Pattern> patterns;
+        // The index is sized by the largest id, loading rejects states with ids from here on
+        static constexpr int MAX_PATTERN_ID = 1 << 16;
+
+        // Add and remove patterns only through State methods, otherwise call rebuild_index().
+        // Copies of a State share the patterns that neither of them changed,
+        // non-const access to a pattern goes through find_pattern(), which decodes patterns that are still encoded
+        std::vector<Cow<Pattern>> patterns;
         bool play_selected = false;
         bool play_note_triggered = false;
         std::string settings;
@@ -522,29 +1429,89 @@ namespace myseq {
             if (it == patterns.end()) {
                 return nullptr;
                 while (it != patterns.end() &&
-                       !(it->get_first_note() <= note.note && note.note <= it->get_last_note())) {
+                       !((*it)->get_first_note() <= note.note && note.note <= (*it)->get_last_note())) {
                     ++it;
                 }
             } else {
-                auto b = &*it;
+                auto b = &**it;
                 return b;
             }
         }
 
-        [[nodiscard]] int next_unused_id() {
-            int max = -1;
-            for (auto &p: patterns) {
-                if (p.id > max) {
-                    max = p.id;
+        // Returns false when two patterns have the same id, loading rejects such states
+        bool rebuild_index() {
+            id_to_index.clear();
+            bool unique = true;
+            for (int i = 0; i < (int) patterns.size(); i++) {
+                unique &= index_pattern(i);
+            }
+            rebuild_trigger_table();
+            return unique;
+        }
+
+        // Needs to be called after trigger ranges or widths of patterns are changed directly
+        void rebuild_trigger_table() {
+            std::array<int, 129> counts{};
+            for (const auto &p: patterns) {
+                for (int n = std::max(0, p->get_first_note()); n <= std::min(127, p->get_last_note()); n++) {
+                    counts[n + 1]++;
+                }
+            }
+            for (int n = 0; n < 128; n++) {
+                counts[n + 1] += counts[n];
+            }
+            trigger_begin = counts;
+            trigger_targets.resize(counts[128]);
+            for (const auto &cow: patterns) {
+                const auto &p = *cow;
+                const auto total_notes = p.get_last_note() - p.get_first_note() + 1;
+                for (int n = std::max(0, p.get_first_note()); n <= std::min(127, p.get_last_note()); n++) {
+                    const auto percent_from_start = (float) (n - p.get_first_note()) / (float) total_notes;
+                    trigger_targets[counts[n]++] = {p.get_id(), percent_from_start, p.get_width()};
                 }
             }
-            return max + 1;
         }
 
-        [[nodiscard]] Opaque to_json() const;
+        template<typename F>
+        void each_trigger_target(uint8_t note, F f) const {
+            assert(note <= 127);
+            const auto end = trigger_begin[note + 1];
+            for (auto i = trigger_begin[note]; i < end; i++) {
+                f(trigger_targets[i]);
+            }
+        }
+
+        [[nodiscard]] int next_unused_id() const {
+            return (int) id_to_index.size();
+        }
 
         [[nodiscard]] std::string to_json_string() const;
 
+        // Replaces what is in out, keeping its capacity
+        void write_json(std::string &out) const;
+
+        // Streams to the file without building the text in memory first
+        bool write_json_file(const char *state_file) const;
+
+        // Versioned little-endian encoding, see Patterns.cpp. Raw bytes for files,
+        // base64 of them for the host, which stores state as a C string
+        [[nodiscard]] std::string to_binary() const;
+
+        void write_binary(std::string &out) const;
+
+        [[nodiscard]] std::string to_base64() const;
+
+        // Combines the content hashes of the patterns with the playback settings, costs one step
+        // per pattern. The ImGui settings string is not included
+        [[nodiscard]] uint64_t content_hash() const {
+            auto h = utils::hash_combine(static_cast<uint64_t>(selected),
+                                         (uint64_t(play_selected) << 1) | uint64_t(play_note_triggered));
+            for (const auto &p: patterns) {
+                h = utils::hash_combine(h, p->content_hash());
+            }
+            return h;
+        }
+
         [[nodiscard]] auto num_patterns() const {
             return patterns.size();
         }
@@ -552,17 +1519,18 @@ namespace myseq {
         // Its safe to delete as player will stop playing missing IDs
         void delete_pattern(const int id) {
             for (auto it = patterns.begin(); it != patterns.end(); it++) {
-                if (it->id == id) {
+                if ((*it)->id == id) {
                     it = patterns.erase(it);
+                    rebuild_index();
                     if (it == patterns.end()) {
                         if (!patterns.empty()) {
                             it--;
-                            selected = it->id;
+                            selected = (*it)->id;
                         } else {
                             selected = -1;
                         }
                     } else {
-                        selected = it->id;
+                        selected = (*it)->id;
                     }
                     return;
                 }
@@ -578,7 +1546,7 @@ namespace myseq {
         [[nodiscard]] std::pair<int, int> first_16_range() const {
             int used[128]{};
             for (auto &p: patterns) {
-                for (int i = p.get_first_note(); i <= p.get_last_note(); i++) {
+                for (int i = p->get_first_note(); i <= p->get_last_note(); i++) {
                     used[i]++;
                 }
             }
@@ -595,14 +1563,59 @@ namespace myseq {
             Pattern p = Pattern(next_unused_id());
             const auto range = first_16_range();
             p.set_note_trigger_range(range.first, 16);
-            patterns.push_back(p);
-            return patterns.back();
+            patterns.emplace_back(std::move(p));
+            index_pattern((int) patterns.size() - 1);
+            rebuild_trigger_table();
+            return patterns.back().mutate();
+        }
+
+        // Inserts a pattern with an id that is not in use yet before patterns[index], appends by default
+        Pattern &add_pattern(const Pattern &pattern, std::size_t index = std::numeric_limits<std::size_t>::max()) {
+            assert(!has_pattern(pattern.id));
+            index = std::min(index, patterns.size());
+            patterns.emplace(patterns.begin() + (std::ptrdiff_t) index, pattern);
+            rebuild_index();
+            return mutate_pattern(index);
+        }
+
+        // Called on a copy that is about to be handed to the audio thread: gives it its own copy
+        // of every pattern, so that editing them does not copy, and leaves room for `headroom`
+        // new cells per pattern. Patterns that are still encoded stay shared, the audio thread plays
+        // them as empty until a later snapshot has them decoded
+        void prepare_for_realtime(std::size_t headroom) {
+            for (auto &p: patterns) {
+                if (p->is_decoded()) {
+                    p.mutate().reserve_cells(headroom);
+                }
+            }
+        }
+
+        // For readers that need every pattern right away, like the renderer
+        void decode_all() {
+            for (std::size_t i = 0; i < patterns.size(); i++) {
+                decode(i);
+            }
+        }
+
+        // Puts in a pattern that was decoded elsewhere if this State still has it encoded,
+        // see PatternDecoder. Returns whether it did
+        bool adopt_decoded(const Cow<Pattern> &encoded, Cow<Pattern> decoded) {
+            const auto id = encoded->id;
+            if (id < 0 || id >= (int) id_to_index.size() || id_to_index[id] < 0
+                || !patterns[id_to_index[id]].shares_with(encoded)) {
+                return false;
+            }
+            patterns[id_to_index[id]] = std::move(decoded);
+            return true;
         }
 
         Pattern &duplicate_pattern(int id) {
-            auto pattern = get_pattern(id);
+            auto pattern = std::as_const(*this).get_pattern(id);
             pattern.id = next_unused_id();
-            return patterns.emplace_back(pattern);
+            patterns.emplace_back(std::move(pattern));
+            index_pattern((int) patterns.size() - 1);
+            rebuild_trigger_table();
+            return mutate_pattern(patterns.size() - 1);
         }
 
         void set_selected_id(int id) {
@@ -621,35 +1634,109 @@ namespace myseq {
             return get_pattern(selected);
         }
 
-        Pattern &get_pattern(int id) {
-            for (auto &p: patterns) {
-                if (p.id == id) {
-                    return p;
-                }
+        // Returns nullptr when there is no pattern with this id.
+        // Decodes the pattern first if it is still encoded and copies it if another State shares it
+        [[nodiscard]] Pattern *find_pattern(int id) {
+            if (id < 0 || id >= (int) id_to_index.size() || id_to_index[id] < 0) {
+                return nullptr;
             }
-            return *(patterns.end());
+            return &mutate_pattern(id_to_index[id]);
         }
 
-        [[nodiscard]] const Pattern &get_pattern(int id) const {
-            for (const auto &p: patterns) {
-                if (p.id == id) {
-                    return p;
-                }
+        // For the audio thread: the pattern if it can be edited without decoding or copying it,
+        // nullptr when there is none or it is still encoded or shared with another State
+        [[nodiscard]] Pattern *find_pattern_in_place(int id) {
+            if (id < 0 || id >= (int) id_to_index.size() || id_to_index[id] < 0) {
+                return nullptr;
+            }
+            auto &cow = patterns[id_to_index[id]];
+            if (!cow->is_decoded() || cow.is_shared()) {
+                return nullptr;
             }
-            return *(patterns.end());
+            return &cow.mutate();
+        }
+
+        // A pattern that is still encoded reads as empty
+        [[nodiscard]] const Pattern *find_pattern(int id) const {
+            if (id < 0 || id >= (int) id_to_index.size() || id_to_index[id] < 0) {
+                return nullptr;
+            }
+            return &*patterns[id_to_index[id]];
+        }
+
+        [[nodiscard]] bool has_pattern(int id) const {
+            return find_pattern(id) != nullptr;
+        }
+
+        Pattern &get_pattern(int id) {
+            auto p = find_pattern(id);
+            assert(p != nullptr);
+            return *p;
+        }
+
+        [[nodiscard]] const Pattern &get_pattern(int id) const {
+            auto p = find_pattern(id);
+            assert(p != nullptr);
+            return *p;
         }
 
         template<typename F>
-        void each_pattern(F f) {
-            for (auto &p: patterns) {
-                f(p);
+        void each_pattern(F f) const {
+            for (const auto &p: patterns) {
+                f(*p);
             }
         }
 
         static State from_json_string(const char *s);
 
-        void write_to_file(const char *state_file) const {
-            const auto value = to_json_string();
+        static State from_binary(const char *data, std::size_t size);
+
+        // Reads only the pattern headers of the current version, the notes and lane events of
+        // every pattern stay encoded in bytes until the pattern is decoded
+        static State from_binary(std::shared_ptr<const std::string> bytes);
+
+        // Tells JSON, binary and base64 binary apart
+        static State from_string(const char *s, std::size_t size);
+
+        static State from_string(const std::string &s) {
+            return from_string(s.data(), s.size());
+        }
+
+        enum class FileFormat {
+            Json,
+            Binary,
+        };
+
+        // The format of a state file's content, Binary when it starts with the binary magic
+        static FileFormat file_format_of(const char *s, std::size_t size);
+
+        static FileFormat file_format_of(const std::string &s) {
+            return file_format_of(s.data(), s.size());
+        }
+
+        // The format for a state file that is new: binary only when it is named *.bin, so that
+        // a JSON file is never turned into binary unless asked for
+        static FileFormat file_format_for_name(const char *state_file) {
+            const auto length = std::strlen(state_file);
+            return length >= 4 && std::strcmp(state_file + length - 4, ".bin") == 0 ? FileFormat::Binary
+                                                                                     : FileFormat::Json;
+        }
+
+        // What write_to_file() writes, into out
+        void write_file_content(FileFormat format, std::string &out) const {
+            if (format == FileFormat::Json) {
+                write_json(out);
+            } else {
+                write_binary(out);
+            }
+        }
+
+        void write_to_file(const char *state_file, FileFormat format) const {
+            if (format == FileFormat::Json) {
+                write_json_file(state_file);
+                return;
+            }
+            const auto value = to_binary();
             d_debug("write_file %s %lu bytes", state_file, value.length());
             write_file(state_file, value.c_str(), value.size());
         }
@@ -658,7 +1745,7 @@ namespace myseq {
             const auto content = read_file(state_file);
             if (content.has_value()) {
                 d_debug("read_file %s %lu", state_file, content->length());
-                return {myseq::State::from_json_string(content.value().c_str())};
+                return {myseq::State::from_string(content.value())};
             } else {
                 d_debug("read_file %s failed", state_file);
             }
@@ -7,10 +7,12 @@
 
 #include <optional>
 #include <sstream>
+#include <limits>
 #include "MyAssert.hpp"
 #include "Patterns.hpp"
 #include "TimePositionCalc.hpp"
 #include "Stats.hpp"
+#include "FixedVector.hpp"
 
 namespace myseq {
     struct TimeParams {
@@ -19,45 +21,65 @@ namespace myseq {
         double window;
         bool playing;
         int iteration;
+
+        static TimeParams from_time_position(const TimePositionCalc &tc, uint32_t frames, int iteration) {
+            return {tc.global_tick(), tc.sixteenth_note_duration_in_ticks(),
+                    ((double) frames) / tc.frames_per_tick(), tc.t.playing, iteration};
+        }
     };
 
+    // Notes are always played on channel 0, so at most 128 can be held at once
+    static constexpr std::size_t MAX_HELD_NOTES = 128;
+
+    // Patterns triggered beyond this are not started
+    static constexpr std::size_t MAX_ACTIVE_PATTERNS = 256;
+
+    // Fraction of a step kept between a block end and ActivePattern::next_due,
+    // so that rounding never skips a block that has events
+    static constexpr double CURSOR_MARGIN = 1e-6;
+
     struct ActiveNoteData {
+        Note note;
         double end_time;
     };
 
     struct ActiveNotes {
-        std::map<Note, ActiveNoteData> m;
+        // Kept sorted by note
+        FixedVector<ActiveNoteData, MAX_HELD_NOTES> m;
 
         template<typename F>
         void
         play_note(F note_event, uint8_t note, uint8_t velocity, double start_time, double end_time) {
             Note note1 = {note, 0};
-            auto active = m.find(note1);
-            if (active != m.end()) {
-                note_event(active->first.note, 0.0, start_time);
-                m.erase(active);
+            auto active = std::lower_bound(m.begin(), m.end(), note1, [](const ActiveNoteData &a, const Note &b) {
+                return a.note < b;
+            });
+            if (active != m.end() && active->note == note1) {
+                note_event(active->note.note, 0.0, start_time);
+                active->end_time = end_time;
+            } else if (!m.insert(active, {note1, end_time})) {
+                d_debug("ActiveNotes: too many held notes, dropping %d", note);
+                return;
             }
-            m[note1] = {end_time};
             note_event(note, velocity, start_time);
         }
 
         template<typename F>
         void handle_note_offs(F note_event, const TimeParams &tp) {
-            for (auto it = m.begin(); it != m.end();) {
-                double t = it->second.end_time - tp.time;
+            m.erase_if([&](const ActiveNoteData &a) {
+                double t = a.end_time - tp.time;
                 if (t < tp.window) {
-                    note_event(it->first.note, 0.0, t);
-                    it = m.erase(it);
-                } else {
-                    ++it;
+                    note_event(a.note.note, 0.0, t);
+                    return true;
                 }
-            }
+                return false;
+            });
         }
 
         template<typename F>
         void stop_notes(F note_event) {
-            for (auto it: m) {
-                note_event(it.first.note, 0.0, 0.0);
+            for (const auto &a: m) {
+                note_event(a.note.note, 0.0, 0.0);
             }
             m.clear();
         }
@@ -77,26 +99,51 @@ namespace myseq {
         };
 
         Stats stats;
+
+        // Blocks that end before this time have no events for this pattern and are skipped,
+        // -infinity when it has to be recomputed (edits, new state, transport jumps)
+        double next_due = -std::numeric_limits<double>::infinity();
     };
 
 
     struct Player {
-        std::vector<ActivePattern> active_patterns;
+        FixedVector<ActivePattern, MAX_ACTIVE_PATTERNS> active_patterns;
         std::optional<ActivePattern> selected_active_pattern;
         ActiveNotes an = ActiveNotes();
+        // what the next_due times of active_patterns were computed against
+        const State *cursor_state = nullptr;
+        double cursor_step_duration = 0.0;
+        double cursor_window_end = 0.0;
 
         Player() = default;
 
-        static double pattern_start_time_offset(const Pattern &p, const Note &note, const TimeParams &tp) {
-            const auto total_notes = p.get_last_note() - p.get_first_note() + 1;
-            const auto percent_from_start = (float) (note.note - p.get_first_note()) / (float) total_notes;
-            const double pattern_duration = tp.step_duration * static_cast<double>(p.get_width());
-            return percent_from_start * pattern_duration;
+        void invalidate_cursors() {
+            for (auto &ap: active_patterns) {
+                ap.next_due = -std::numeric_limits<double>::infinity();
+            }
+        }
+
+        // Called when a pattern was edited in place
+        void invalidate_cursors(int pattern_id) {
+            for (auto &ap: active_patterns) {
+                if (ap.pattern_id == pattern_id) {
+                    ap.next_due = -std::numeric_limits<double>::infinity();
+                }
+            }
+        }
+
+        static double pattern_start_time_offset(const TriggerTarget &target, const TimeParams &tp) {
+            const double pattern_duration = tp.step_duration * static_cast<double>(target.width);
+            return target.start_offset * pattern_duration;
         }
 
         void play_selected_pattern(const myseq::State &state) {
-            auto &p = state.get_selected_pattern();
-            const ActivePattern ap = {p.get_id(), 0.0, 0.0, false, Note(p.get_first_note(), 0), 127, {}};
+            const auto *p = state.find_pattern(state.get_selected_id());
+            if (p == nullptr) {
+                stop_selected_pattern();
+                return;
+            }
+            const ActivePattern ap = {p->get_id(), 0.0, 0.0, false, Note(p->get_first_note(), 0), 127, {}};
             selected_active_pattern = {ap};
         }
 
@@ -108,17 +155,46 @@ namespace myseq {
         start_note_triggered(const State &state, const Note &note, uint8_t velocity, double start_time,
                              const TimeParams &tp) {
             d_debug("start_note_triggered: %d %d %f", note.note, velocity, start_time);
-            active_patterns.erase(
-                    std::remove_if(active_patterns.begin(), active_patterns.end(), [&note](auto other) -> bool {
-                        return other.note == note;
-                    }), active_patterns.end());
+            active_patterns.erase_if([&note](const ActivePattern &other) -> bool {
+                return other.note == note;
+            });
+
+            state.each_trigger_target(note.note, [&](const TriggerTarget &target) {
+                const auto new_start_time = start_time - pattern_start_time_offset(target, tp);
+                if (!active_patterns.push_back({target.pattern_id, new_start_time, 0.0, false, note, velocity, {}})) {
+                    d_debug("start_note_triggered: too many active patterns, dropping %d", target.pattern_id);
+                }
+            });
+        }
 
-            for (auto &p: state.patterns) {
-                if (!(p.get_first_note() <= note.note && note.note <= p.get_last_note())) {
-                    continue;
+        // Applies the playback modes of state and the note input of a block;
+        // each_message(f) calls f(const NoteMessage &, double time) for every input note message in order
+        template<typename G>
+        void handle_input(const State &state, G each_message, const TimeParams &tp) {
+            // if only currently selected (in the UI) pattern should be played
+            if (state.num_patterns() > 0) {
+                if (state.play_selected) {
+                    play_selected_pattern(state);
+                } else {
+                    stop_selected_pattern();
                 }
-                const auto new_start_time = start_time - pattern_start_time_offset(p, note, tp);
-                active_patterns.push_back({p.get_id(), new_start_time, 0.0, false, note, velocity, {}});
+            }
+
+            if (state.play_note_triggered) {
+                each_message([&](const NoteMessage &msg, double time) {
+                    switch (msg.type) {
+                        case NoteMessage::Type::NoteOn:
+                            start_note_triggered(state, msg.note, msg.velocity, time, tp);
+                            break;
+                        case NoteMessage::Type::NoteOff:
+                            stop_patterns(msg.note, time);
+                            break;
+                        default:
+                            break;
+                    }
+                });
+            } else {
+                stop_note_triggered();
             }
         }
 
@@ -128,6 +204,7 @@ namespace myseq {
                 if (ap.note == note && !ap.finished) {
                     ap.end_time = end_time;
                     ap.finished = true;
+                    ap.next_due = -std::numeric_limits<double>::infinity();
                 }
             }
         }
@@ -166,30 +243,75 @@ namespace myseq {
 
         void push_active_pattern_stats(myseq::Stats &stats, const myseq::State &state, const TimeParams &tp) {
             for (const auto &ap: active_patterns) {
-                const auto &p = state.get_pattern(ap.pattern_id);
+                const auto *p = state.find_pattern(ap.pattern_id);
+                if (p == nullptr) {
+                    continue;
+                }
                 myseq::ActivePatternStats aps = {
                         .pattern_id = ap.pattern_id,
-                        .duration = calc_pattern_duration(p, tp),
+                        .duration = calc_pattern_duration(*p, tp),
                         .time = std::fmod(calc_pattern_elapsed(ap, tp), aps.duration)
                 };
                 stats.active_patterns.push_back(aps);
             }
             if (selected_active_pattern.has_value()) {
                 const auto &ap = *selected_active_pattern;
-                const auto &p = state.get_pattern(ap.pattern_id);
-                myseq::ActivePatternStats aps = {
-                        .pattern_id = ap.pattern_id,
-                        .duration = calc_pattern_duration(p, tp),
-                        .time = std::fmod(calc_pattern_elapsed(ap, tp), aps.duration)
-                };
-                stats.active_patterns.push_back(aps);
+                const auto *p = state.find_pattern(ap.pattern_id);
+                if (p != nullptr) {
+                    myseq::ActivePatternStats aps = {
+                            .pattern_id = ap.pattern_id,
+                            .duration = calc_pattern_duration(*p, tp),
+                            .time = std::fmod(calc_pattern_elapsed(ap, tp), aps.duration)
+                    };
+                    stats.active_patterns.push_back(aps);
+                }
             }
         }
 
+        // Start time of the first column from `column` on (counting past the pattern end) that has notes
+        static double next_note_column_time(const Pattern &p, double cycle_start, int column, double step_duration) {
+            const auto from = column % p.width;
+            auto next = p.next_column_with_notes(from);
+            auto i = column + next - from;
+            if (next < 0) {
+                next = p.next_column_with_notes(0);
+                i = column + p.width - from + next;
+                if (next < 0 || next >= from) {
+                    return std::numeric_limits<double>::infinity();
+                }
+            }
+            return cycle_start + static_cast<double>(i) * step_duration;
+        }
+
+        // Start time of the first lane event from `tick` on (counting past the pattern end)
+        static double next_lane_event_time(const Pattern &p, double cycle_start, double tick, double tick_duration) {
+            const auto lane_ticks = static_cast<double>(p.lane_ticks());
+            auto cycle = std::floor(tick / lane_ticks) * lane_ticks;
+            auto next = p.next_lane_offset(static_cast<int>(std::ceil(tick - cycle)));
+            if (next < 0) {
+                next = p.next_lane_offset(0);
+                cycle += lane_ticks;
+                if (next < 0) {
+                    return std::numeric_limits<double>::infinity();
+                }
+            }
+            return cycle_start + (cycle + next) * tick_duration;
+        }
+
         template<typename F>
         bool
         run_active_pattern(F note_event, ActivePattern &ap, const myseq::State &state, const TimeParams &tp) {
-            const auto &p = state.get_pattern(ap.pattern_id);
+            // nothing to play in this block, only keep the stats moving
+            if (tp.time + tp.window < ap.next_due) {
+                ap.stats.time = std::fmod(tp.time - ap.start_time, ap.stats.duration);
+                return true;
+            }
+            // pattern was deleted while playing
+            const auto *pp = state.find_pattern(ap.pattern_id);
+            if (pp == nullptr) {
+                return false;
+            }
+            const auto &p = *pp;
             double window_start = tp.time;
             double window_end = ap.finished ? std::min(window_start + tp.window, ap.end_time) :
                                 window_start + tp.window;
@@ -214,77 +336,130 @@ namespace myseq {
                 return true;
             }
 
+            // plays a note that starts at time within the block and lasts duration
+            auto play = [&](uint8_t note, uint8_t velocity, double time, double duration) {
+                const auto step_end_time = window_start + time + duration;
+                const auto note_end_time = ap.finished ? std::min(step_end_time,
+                                                                  ap.end_time)
+                                                       : step_end_time;
+
+                // This check prevents 0-length notes being played when input note ends
+                // exactly at the end of the step and just before the beginning of the next step
+                // I believe this is caused by either note starting time calculation or
+                // pattern end time calculation being incorrect (or both)
+                // 1.0 here represents 1 MIDI tick which is supposed to be the smallest possible note length
+                // however it seems that <1.0 is also a valid note length (at least in REAPER)
+                const auto note_length = note_end_time - (window_start + time);
+                if (note_length > (ap.finished ? 1.0 : 0.0)) {
+                    if (ap.finished) {
+                        d_debug("FINISHED NOTE ON iteration=%d note=%d time=%f note_length=%f",
+                                tp.iteration,
+                                ap.note.note,
+                                tp.time + time,
+                                note_length);
+                    }
+                    an.play_note(note_event, note,
+                                 note_out_velocity(ap, velocity),
+                                 time,
+                                 note_end_time
+                    );
+                }
+            };
+
             for (auto i = next_column; i <= last_column; i++) {
                 const auto column_index = i % p.width;
                 auto column_time = static_cast<double>(i) * step_duration - pattern_time;
-                for (int row_index = 0; row_index < p.height; row_index++) {
-                    const auto coords = V2i(column_index, row_index);
-                    if (p.is_extension_of_tied(coords)) {
-                        continue;
-                    }
-                    const auto v = p.get_velocity(coords);
-                    if (v > 0) {
-                        const auto length = static_cast<double>(p.get_length(coords));
-                        const auto step_end_time = window_start + column_time + step_duration * length;
-                        const auto note_end_time = ap.finished ? std::min(step_end_time,
-                                                                          ap.end_time)
-                                                               : step_end_time;
-
-                        // This check prevents 0-length notes being played when input note ends
-                        // exactly at the end of the step and just before the beginning of the next step
-                        // I believe this is caused by either note starting time calculation or
-                        // pattern end time calculation being incorrect (or both)
-                        // 1.0 here represents 1 MIDI tick which is supposed to be the smallest possible note length
-                        // however it seems that <1.0 is also a valid note length (at least in REAPER)
-                        const auto note_length = note_end_time - (window_start + column_time);
-                        if (note_length > (ap.finished ? 1.0 : 0.0)) {
-                            if (ap.finished) {
-                                d_debug("FINISHED NOTE ON iteration=%d note=%d time=%f note_length=%f",
-                                        tp.iteration,
-                                        ap.note.note,
-                                        tp.time + column_time,
-                                        note_length);
-                            }
-                            an.play_note(note_event, utils::row_index_to_midi_note(row_index),
-                                         note_out_velocity(ap, v),
-                                         column_time,
-                                         note_end_time
-                            );
+                p.each_note_in_column(column_index, [&](const ScheduledNote &sn) {
+                    play(sn.note, sn.velocity, column_time, step_duration * static_cast<double>(sn.length));
+                });
+            }
+
+            // lane events in [pattern_time, pattern_time + window), one pattern cycle at a time
+            const auto tick_duration = step_duration / Pattern::LANE_TICKS_PER_STEP;
+            double lane_next_due = std::numeric_limits<double>::infinity();
+            if (p.has_lane_events()) {
+                const auto lane_ticks = static_cast<double>(p.lane_ticks());
+                const auto from = pattern_time / tick_duration;
+                const auto to = (pattern_time + tp.window) / tick_duration;
+                for (double cycle = 0.0; cycle < to; cycle += lane_ticks) {
+                    const auto lo = static_cast<int>(std::ceil(std::max(from - cycle, 0.0)));
+                    const auto hi = static_cast<int>(std::ceil(std::min(to - cycle, lane_ticks)));
+                    p.each_lane_event_between(lo, hi, [&](int row, const LaneEvent &e) {
+                        if (e.velocity > 0) {
+                            play(utils::row_index_to_midi_note(row), e.velocity,
+                                 (cycle + e.offset) * tick_duration - pattern_time,
+                                 static_cast<double>(e.length) * tick_duration);
                         }
-                    }
+                    });
                 }
+                lane_next_due = next_lane_event_time(p, window_start - pattern_time, to, tick_duration);
+            }
+            // from last_column: a column that starts exactly at the window end is played again by the next block
+            auto next_due = std::min(next_note_column_time(p, window_start - pattern_time, last_column, step_duration),
+                                     lane_next_due);
+            if (ap.finished) {
+                next_due = std::min(next_due, ap.end_time);
             }
+            ap.next_due = next_due - step_duration * CURSOR_MARGIN;
             return true;
         }
 
         template<typename F>
         void run(F note_event, const myseq::State &state, const TimeParams &tp) {
             if (tp.playing) {
-                for (auto it = active_patterns.begin(); it != active_patterns.end();) {
-                    auto &ap = *it;
+                if (&state != cursor_state || tp.step_duration != cursor_step_duration
+                    || std::abs(tp.time - cursor_window_end) > tp.step_duration * CURSOR_MARGIN) {
+                    invalidate_cursors();
+                }
+                cursor_state = &state;
+                cursor_step_duration = tp.step_duration;
+                cursor_window_end = tp.time + tp.window;
+                active_patterns.erase_if([&](ActivePattern &ap) {
                     if (!run_active_pattern(note_event, ap, state, tp)) {
                         d_debug("REMOVING ACTIVE PATTERN %d", ap.pattern_id);
-                        it = active_patterns.erase(it);
-                    } else {
-                        ++it;
+                        return true;
                     }
-                }
+                    return false;
+                });
                 if (selected_active_pattern.has_value()) {
                     run_active_pattern(note_event, *selected_active_pattern, state, tp);
                 }
                 an.handle_note_offs(note_event, tp);
             } else {
                 active_patterns.clear();
+                cursor_state = nullptr;
                 an.stop_notes(note_event);
             }
         }
     };
 
     struct Test {
+        static void test_active_notes() {
+            ActiveNotes an;
+            std::vector<std::pair<uint8_t, uint8_t>> events;
+            auto f = [&](uint8_t note, uint8_t velocity, double) {
+                events.emplace_back(note, velocity);
+            };
+            an.play_note(f, 64, 100, 0.0, 10.0);
+            an.play_note(f, 60, 100, 0.0, 20.0);
+            an.play_note(f, 64, 90, 5.0, 30.0);
+            assert(an.m.size() == 2);
+            assert(an.m[0].note.note == 60 && an.m[1].note.note == 64);
+            assert(events.size() == 4 && events[2] == std::make_pair((uint8_t) 64, (uint8_t) 0));
+            TimeParams tp{};
+            tp.time = 0.0;
+            tp.window = 25.0;
+            an.handle_note_offs(f, tp);
+            assert(an.m.size() == 1 && an.m[0].note.note == 64);
+            an.stop_notes(f);
+            assert(an.m.empty());
+        }
+
         static void test_player_run() {
             State state;
             auto &p = state.create_pattern();
             p.set_note_trigger_range(0, 15);
+            state.rebuild_trigger_table();
             std::cout << "p.id=" << p.id << std::endl;
             std::cout << "p.first_note=" << p.get_first_note() << std::endl;
             std::cout << "p.last_note=" << p.get_last_note() << std::endl;
@@ -304,6 +479,39 @@ namespace myseq {
 
             std::cout << "END TEST\n";
         }
+
+        // Lane events play at their offset whatever the block size, once per pattern cycle
+        static void test_lane_playback() {
+            State state;
+            auto &p = state.create_pattern();
+            p.resize_width(4);
+            p.set_lane_event(utils::midi_note_to_row_index(60), {130, 100, 50});
+            p.set_lane_event(utils::midi_note_to_row_index(62), {1919, 90, 1});
+            state.set_selected_id(p.id);
+            state.play_selected = true;
+            for (const double window: {7.0, 64.0, 1000.0, 5000.0}) {
+                Player player;
+                std::vector<std::pair<uint8_t, double>> starts;
+                TimeParams tp{0.0, 480.0, window, true, 0};
+                for (; tp.time < 2 * 1920.0; tp.time += window) {
+                    player.handle_input(state, [](auto) {}, tp);
+                    player.run([&](uint8_t note, uint8_t velocity, double time) {
+                        if (velocity > 0) {
+                            starts.emplace_back(note, tp.time + time);
+                        }
+                    }, state, tp);
+                    tp.iteration++;
+                }
+                std::sort(starts.begin(), starts.end(), [](const auto &a, const auto &b) {
+                    return a.second < b.second;
+                });
+                assert(starts.size() >= 4);
+                assert(starts[0].first == 60 && std::abs(starts[0].second - 130.0) < 1e-6);
+                assert(starts[1].first == 62 && std::abs(starts[1].second - 1919.0) < 1e-6);
+                assert(starts[2].first == 60 && std::abs(starts[2].second - 2050.0) < 1e-6);
+                assert(starts[3].first == 62 && std::abs(starts[3].second - 3839.0) < 1e-6);
+            }
+        }
     };
 }
 
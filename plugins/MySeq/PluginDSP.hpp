@@ -10,12 +10,20 @@
 #include <chrono>
 #include <map>
 #include <iomanip>
+#include <mutex>
+#include <algorithm>
 #include "MyAssert.hpp"
 #include "DistrhoPlugin.hpp"
+#include "extra/RingBuffer.hpp"
 #include "Patterns.hpp"
 #include "Player.hpp"
 #include "Utils.hpp"
 #include "TimePositionCalc.hpp"
+#include "RtAllocGuard.hpp"
+#include "SnapshotHandoff.hpp"
+#include "PatternDecoder.hpp"
+#include "Edits.hpp"
+#include "MidiOutBuffer.hpp"
 
 START_NAMESPACE_DISTRHO
 
@@ -26,15 +34,47 @@ START_NAMESPACE_DISTRHO
            You must set all parameter values to their defaults, matching ParameterRanges::def.
 
          */
+        // What run() plays: a copy of state, kept up to date with edits from the ring buffer
+        // until a structural change replaces it with a new copy
+        struct RtState {
+            myseq::State state;
+            // last edit included in state
+            uint64_t edit_seq;
+        };
+
+        // Edits per pattern the audio thread can take before it would need to allocate
+        static constexpr int EDIT_HEADROOM = 256;
+        static constexpr uint32_t EDIT_RING_SIZE = 64 * 1024;
+
         myseq::Player player;
+        myseq::MidiOutBuffer midi_out;
+        // Owned by the host/UI threads: setState/getState/initState/sync_state
         myseq::State state;
+        mutable std::mutex state_mutex;
+        uint64_t edit_seq = 0;
+        int cell_edits_since_snapshot = 0;
+        // ids of patterns the decoder put into state since the last snapshot, the audio thread
+        // still has them encoded
+        std::vector<int> decoded_since_snapshot;
+        myseq::SnapshotHandoff<RtState> rt_state{std::make_unique<RtState>(RtState{myseq::State(), 0})};
+        // single producer (sync_state under state_mutex), single consumer (run)
+        HeapRingBuffer rt_edits;
         String filename = String("");
         TimePosition last_time_position;
         int iteration = 0;
+        // Decodes loaded patterns into state and publishes them. Last, so that its thread stops
+        // before the members it uses go away
+        myseq::PatternDecoder decoder;
 
         MySeqPlugin()
                 : Plugin(0, 0, 2) {
+            rt_edits.createBuffer(EDIT_RING_SIZE);
+            myseq::Test::test_active_notes();
             myseq::Test::test_player_run();
+            myseq::Test::test_lane_playback();
+            myseq::test_midi_out_buffer();
+            myseq::test_column_scan();
+            myseq::test_snapshot_handoff();
         }
 
     protected:
@@ -87,65 +127,128 @@ START_NAMESPACE_DISTRHO
                    && player.active_patterns[0].note == myseq::Note{127, 127};
         }
 
-        void run_player1([[maybe_unused]] const MidiEvent *midiEvents,
-                         [[maybe_unused]] uint32_t midiEventCount, const myseq::TimePositionCalc &tc,
-                         const myseq::TimeParams &tp) {
-
-            // if only currently selected (in the UI) pattern should be played
-            if (state.num_patterns() > 0) {
-                if (state.play_selected) {
-                    player.play_selected_pattern(state);
-                } else {
-                    player.stop_selected_pattern();
+        // Called with state_mutex held
+        void publish_state() {
+            auto next = std::make_unique<RtState>(RtState{state, edit_seq});
+            next->state.prepare_for_realtime(EDIT_HEADROOM);
+            cell_edits_since_snapshot = 0;
+            decoded_since_snapshot.clear();
+            rt_state.publish(std::move(next));
+        }
+
+    public:
+        // Called by the UI (direct access) after every change instead of sending the whole state as JSON.
+        // Applies the difference to state and forwards it to the audio thread as edits, or as a new
+        // snapshot when patterns were added, removed, resized or retriggered, or the ring buffer is full
+        void sync_state(const myseq::State &ui_state) {
+            std::vector<myseq::EditOp> ops;
+            const std::lock_guard<std::mutex> lock(state_mutex);
+            myseq::diff_states(state, ui_state, ops);
+            state.settings = ui_state.settings;
+
+            bool needs_snapshot = false;
+            int cell_edits = 0;
+            for (auto &op: ops) {
+                // only ops the audio thread sees are numbered, so that it can tell a gap from an op it does not need
+                if (op.affects_playback()) {
+                    op.seq = ++edit_seq;
+                }
+                // the audio thread's copy of a pattern that is still encoded is empty,
+                // applying the op decodes ours and the decoded one goes over in a snapshot
+                const auto *p = std::as_const(state).find_pattern(op.pattern_id);
+                needs_snapshot |= op.affects_playback() && p != nullptr && !p->is_decoded();
+                needs_snapshot |= op.affects_playback() &&
+                                  std::find(decoded_since_snapshot.begin(), decoded_since_snapshot.end(),
+                                            op.pattern_id) != decoded_since_snapshot.end();
+                myseq::apply_edit(state, op);
+                needs_snapshot |= op.needs_snapshot();
+                cell_edits += op.type == myseq::EditOp::Type::SetCell || op.type == myseq::EditOp::Type::SetLaneEvent;
+            }
+            cell_edits_since_snapshot += cell_edits;
+            if (needs_snapshot || cell_edits_since_snapshot > EDIT_HEADROOM) {
+                publish_state();
+                return;
+            }
+            for (const auto &op: ops) {
+                if (!op.affects_playback()) {
+                    continue;
+                }
+                if (rt_edits.getWritableDataSize() < sizeof(op)) {
+                    // the snapshot covers the ops that did not fit, run() skips the rest by seq
+                    publish_state();
+                    return;
+                }
+                rt_edits.writeCustomType(op);
+                // the ring buffer indices are plain integers, order the op before the new head
+                std::atomic_thread_fence(std::memory_order_release);
+                rt_edits.commitWrite();
+            }
+        }
+
+    protected:
+        // Applies edits that follow the snapshot without gaps. A gap means that the
+        // missing ops went into a snapshot that is not picked up yet, so the rest waits for it.
+        // So does an op for a pattern this snapshot still has encoded: the sender only writes those
+        // after publishing a snapshot that has the pattern decoded
+        void apply_rt_edits(RtState &rt) {
+            myseq::EditOp op;
+            while (rt_edits.isDataAvailableForReading()) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (!rt_edits.peekCustomType(op)) {
+                    return;
+                }
+                if (op.seq > rt.edit_seq + 1) {
+                    return;
                 }
+                if (op.seq == rt.edit_seq + 1) {
+                    if (!myseq::apply_edit_in_place(rt.state, op)) {
+                        return;
+                    }
+                    player.invalidate_cursors(op.pattern_id);
+                    rt.edit_seq = op.seq;
+                }
+                rt_edits.readCustomType(op);
             }
+        }
+
+        void run_player1(const myseq::State &snapshot, [[maybe_unused]] const MidiEvent *midiEvents,
+                         [[maybe_unused]] uint32_t midiEventCount, const myseq::TimePositionCalc &tc,
+                         const myseq::TimeParams &tp, uint32_t frames) {
 
-            if (state.play_note_triggered) {
+            player.handle_input(snapshot, [&](auto f) {
                 for (auto i = 0; i < (int) midiEventCount; i++) {
                     auto &ev = midiEvents[i];
-
-                    std::optional<myseq::NoteMessage> msg = myseq::NoteMessage::parse(ev.data);
+                    const auto msg = myseq::NoteMessage::parse(ev.data);
                     if (msg.has_value()) {
-                        const auto &v = msg.value();
-                        const auto time = tp.time + (ev.frame / tc.frames_per_tick());
-                        switch (v.type) {
-                            case myseq::NoteMessage::Type::NoteOn:
-//                                d_debug("PluginDSP: IN: NOTE ON  %3d %d:%d", v.note.note, iteration, ev.frame);
-                                player.start_note_triggered(state, v.note, v.velocity, time, tp);
-                                break;
-                            case myseq::NoteMessage::Type::NoteOff:
-//                                d_debug("PluginDSP: IN: NOTE OFF %3d %d:%d", v.note.note, iteration, ev.frame);
-                                player.stop_patterns(v.note, time);
-                                break;
-                            default:
-                                break;
-                        }
+                        f(msg.value(), tp.time + (ev.frame / tc.frames_per_tick()));
                     }
                 }
-
-            } else {
-                player.stop_note_triggered();
-            }
+            }, tp);
 
             auto send = [&](uint8_t note, uint8_t velocity, double time) {
-                const auto msg = velocity == 0 ? 0x80 : 0x90;
-                const auto frame = static_cast<uint32_t>(time * tc.frames_per_tick());
+                midi_out.push(myseq::block_frame(time, tc.frames_per_tick(), frames), note, velocity);
+            };
+            player.run(send, snapshot, tp);
+            midi_out.finish_block();
+            midi_out.write([&](const myseq::MidiOutEvent &e) {
+                const auto msg = e.velocity == 0 ? 0x80 : 0x90;
                 const MidiEvent evt = {
-                        frame,
+                        e.frame,
                         3, {
                                 (uint8_t) msg,
-                                note, velocity, 0},
+                                e.note, e.velocity, 0},
                         nullptr
                 };
                 const auto k = msg == 0x90 ? "ON " : "OFF";
-                d_debug("PluginDSP: OUT: NOTE %s %3d %d:%d", k, note, iteration, evt.frame);
-                writeMidiEvent(evt);
-            };
-            player.run(send, state, tp);
+                d_debug("PluginDSP: OUT: NOTE %s %3d %d:%d", k, e.note, iteration, evt.frame);
+                return writeMidiEvent(evt);
+            });
         }
 
         void run(const float **inputs, float **outputs, uint32_t frames, [[maybe_unused]] const MidiEvent *midiEvents,
                  [[maybe_unused]] uint32_t midiEventCount) override {
+            [[maybe_unused]] const myseq::RtAllocGuard rt_alloc_guard;
+
             // audio pass-through
             if (inputs[0] != outputs[0])
                 std::memcpy(outputs[0], inputs[0], sizeof(float) * frames);
@@ -156,10 +259,11 @@ START_NAMESPACE_DISTRHO
 
             const TimePosition &t = getTimePosition();
             const myseq::TimePositionCalc tc(t, getSampleRate());
-            const myseq::TimeParams tp = {tc.global_tick(), tc.sixteenth_note_duration_in_ticks(),
-                                          ((double) frames) / tc.frames_per_tick(), t.playing, iteration};
+            const auto tp = myseq::TimeParams::from_time_position(tc, frames, iteration);
 
-            run_player1(midiEvents, midiEventCount, tc, tp);
+            auto &rt = rt_state.acquire();
+            apply_rt_edits(rt);
+            run_player1(rt.state, midiEvents, midiEventCount, tc, tp, frames);
 
             // stats.transport = myseq::transport_from_time_position(t);
             // stats.active_patterns.clear();
@@ -172,7 +276,29 @@ START_NAMESPACE_DISTRHO
         void setState(const char *key, const char *value) override {
             d_debug("PluginDSP: setState: key=%s value=%s", key, value);
             if (std::strcmp(key, "pattern") == 0) {
-                state = myseq::State::from_json_string(value);
+                auto new_state = myseq::State::from_string(value, std::strlen(value));
+                myseq::State loaded;
+                {
+                    const std::lock_guard<std::mutex> lock(state_mutex);
+                    state = std::move(new_state);
+                    publish_state();
+                    loaded = state;
+                }
+                // Only the pattern headers are read. A snapshot copies every decoded pattern, so the decoded
+                // ones go to the audio thread once the selected one is in and once at the end, not per batch.
+                // Until then sync_state() sends a snapshot for edits to patterns that were decoded meanwhile
+                decoder.start(loaded, [this](bool finished) {
+                    const std::lock_guard<std::mutex> lock(state_mutex);
+                    const auto selected_decoded = [&]() {
+                        const auto *p = std::as_const(state).find_pattern(state.get_selected_id());
+                        return p != nullptr && p->is_decoded();
+                    };
+                    const auto selected_was_decoded = selected_decoded();
+                    decoder.adopt(state, &decoded_since_snapshot);
+                    if (!decoded_since_snapshot.empty() && (finished || selected_decoded() != selected_was_decoded)) {
+                        publish_state();
+                    }
+                });
             } else if (std::strcmp(key, "filename") == 0) {
                 filename = value;
             } else {
@@ -183,7 +309,8 @@ START_NAMESPACE_DISTRHO
         String getState(const char *key) const override {
             d_debug("PluginDSP: getState: key=%s", key);
             if (std::strcmp(key, "pattern") == 0) {
-                return String(state.to_json_string().c_str());
+                const std::lock_guard<std::mutex> lock(state_mutex);
+                return String(state.to_base64().c_str());
             } else if (std::strcmp(key, "filename") == 0) {
                 return filename;
             } else {
@@ -193,6 +320,7 @@ START_NAMESPACE_DISTRHO
 
         void activate() override {
             d_debug("PluginDSP: activate");
+            midi_out.clear();
         }
 
         void deactivate() override {
@@ -205,12 +333,15 @@ START_NAMESPACE_DISTRHO
             d_debug("PluginDSP: initState index=%d", index);
             DISTRHO_SAFE_ASSERT(index <= 1);
             switch (index) {
-                case 0:
+                case 0: {
                     st.key = "pattern";
                     st.label = "pattern";
+                    const std::lock_guard<std::mutex> lock(state_mutex);
                     state = myseq::State();
-                    st.defaultValue = String(state.to_json_string().c_str());
+                    publish_state();
+                    st.defaultValue = String(state.to_base64().c_str());
                     break;
+                }
                 case 1:
                     st.key = "filename";
                     st.label = "filename";
@@ -1,9 +1,13 @@
 #include <algorithm>
 #include <unordered_set>
 #include <stack>
+#include <map>
 #include "DistrhoUI.hpp"
 #include "PluginDSP.hpp"
 #include "Patterns.hpp"
+#include "PatternDecoder.hpp"
+#include "GenArray.hpp"
+#include "Undo.hpp"
 #include "Numbers.hpp"
 #include "Notes.hpp"
 #include "TimePositionCalc.hpp"
@@ -31,11 +35,6 @@ START_NAMESPACE_DISTRHO
         V2i cell_max;
     };
 
-    struct UndoItem {
-        std::string descr; 
-        myseq::State state;
-    };
-
     template<typename T>
     T clamp(T value, T min, T max) {
         return std::min(std::max(value, min), max);
@@ -111,6 +110,8 @@ START_NAMESPACE_DISTRHO
                     // ImGuiWindowFlags_NoScrollWithMouse |
                     // ImGuiWindowFlags_NoResize;
         std::vector<myseq::Cell> clipboard;
+        // by pattern id, not part of state so that selecting does not reach the DSP
+        std::map<int, myseq::Selection> selections;
         int last_selected_pattern_id = -1;
 
         bool show_metrics = false;
@@ -119,7 +120,16 @@ START_NAMESPACE_DISTRHO
         std::optional<std::string> filename;
 
         myseq::State state;
-        std::vector<UndoItem> undo_stack{};
+        // decodes the rest of a loaded state, the selected pattern is decoded when the grid shows it
+        myseq::PatternDecoder decoder;
+        myseq::UndoHistory undo_history;
+        myseq::UndoLog undo_log;
+        // reused by write_state_file(), autosave writes the file after every change
+        std::string state_file_content;
+        // what the state file was read as, it is written back the same way
+        myseq::State::FileFormat state_file_format = myseq::State::FileFormat::Json;
+        // content hash of the state last loaded, the undo log of an earlier session must end there
+        uint64_t loaded_hash = 0;
 
         enum class Interaction {
             None,
@@ -148,8 +158,22 @@ START_NAMESPACE_DISTRHO
                 state = myseq::State();
                 settings_imgui_to_state();
             }
+            undo_history.reset(state);
 
             myseq::test_serialize();
+            myseq::test_column_masks();
+            myseq::test_pattern_index();
+            myseq::test_copy_on_write();
+            myseq::test_lanes();
+            myseq::test_content_hash();
+            myseq::test_selection();
+            myseq::test_binary_state();
+            myseq::test_json_reader();
+            myseq::test_replace_notes();
+            myseq::test_lazy_decoding();
+            myseq::test_edits();
+            myseq::test_undo();
+            myseq::test_undo_log();
             offset = ImVec2(0.0f, 500000.0f);
             if (d_isEqual(scaleFactor, 1.0)) {
                 setGeometryConstraints(DISTRHO_UI_DEFAULT_WIDTH, DISTRHO_UI_DEFAULT_HEIGHT);
@@ -165,22 +189,26 @@ START_NAMESPACE_DISTRHO
         }
 
         int publish_count = 0;
-        int publish_last_bytes = 0;
+        // of what the last publish() sent, publishing the same again does nothing
+        std::optional<uint64_t> published_hash;
+        std::string published_settings;
 
+        // The plugin diffs state against its own copy and forwards the edits to the audio thread,
+        // The state is only encoded when the host saves (getState) or for the state file
         void publish() {
-            auto s = state.to_json_string();
-            publish_last_bytes = (int) s.length();
-            d_debug("PluginUI: setState key=pattern value=%s", s.c_str());
-            setState("pattern", s.c_str());
             if (autosave) {
                 settings_imgui_to_state();
-                write_state_file();
             }
-// #ifdef DEBUG
-            {
-                state = myseq::State::from_json_string(s.c_str());
+            const auto hash = state.content_hash();
+            if (published_hash == hash && published_settings == state.settings) {
+                return;
+            }
+            published_hash = hash;
+            published_settings = state.settings;
+            get_plugin()->sync_state(state);
+            if (autosave) {
+                write_state_file();
             }
-// #endif
             publish_count += 1;
         }
 
@@ -219,15 +247,23 @@ START_NAMESPACE_DISTRHO
         void parameterChanged(uint32_t, float) override {}
 
         void push_undo(const char *descr) {
-            undo_stack.push_back({descr, state});
+            undo_history.push(descr, state, ImGui::GetTime());
         }
 
-
         void pop_undo() {
-            if (undo_stack.size() > 1) {
-                undo_stack.pop_back();
-                state = undo_stack.back().state;
-            }
+            undo_log.load(undo_history);
+            undo_history.undo(state);
+            selections.clear();
+        }
+
+        void redo() {
+            undo_log.load(undo_history);
+            undo_history.redo(state);
+            selections.clear();
+        }
+
+        myseq::Selection &selection_of(const myseq::Pattern &p) {
+            return selections[p.id];
         }
 
         [[nodiscard]] myseq::V2i
@@ -383,7 +419,7 @@ START_NAMESPACE_DISTRHO
         grid_copy(const myseq::Pattern &p) {
             clipboard.clear();
             int min_x = p.width;
-            p.each_selected_cell([&](const myseq::Cell &cell) {
+            p.each_selected_cell(selection_of(p), [&](const myseq::Cell &cell) {
                 min_x = std::min(cell.position.x, min_x);
                 clipboard.emplace_back(cell);
             });
@@ -394,9 +430,10 @@ START_NAMESPACE_DISTRHO
 
         void
         grid_paste(bool &dirty, myseq::Pattern &p) {
-            p.deselect_all();
+            auto &selection = selection_of(p);
+            selection.clear();
             const auto at = V2i(p.cursor.x, 0);
-            p.put_cells(clipboard, at);
+            p.put_cells(clipboard, at, selection);
             SET_DIRTY_PUSH_UNDO("paste");
         }
 
@@ -407,17 +444,18 @@ START_NAMESPACE_DISTRHO
             } else if (key_pressed(ImGuiKey_V)) {
                 grid_paste(dirty, p);
             } else if (key_pressed(ImGuiKey_A)) {
-                p.each_cell([&](const myseq::Cell &c) {
-                    p.set_selected(c.position, true);
-                });
-                SET_DIRTY();
+                p.select_all(selection_of(p));
             }
         }
 
         void
         general_keyboard_interaction(bool &dirty) {
             if (key_pressed(ImGuiKey_U)) {
-                pop_undo();
+                if (shift_held()) {
+                    redo();
+                } else {
+                    pop_undo();
+                }
                 SET_DIRTY();
             }
         }
@@ -426,15 +464,14 @@ START_NAMESPACE_DISTRHO
         grid_keyboard_interaction_no_mod(bool &dirty, myseq::Pattern &p) {
             auto shift_held = ImGui::GetIO().KeyShift;
             if (key_pressed(ImGuiKey_D) || key_pressed(ImGuiKey_Backspace) || key_pressed(ImGuiKey_Delete)) {
-                p.each_selected_cell([&](const myseq::Cell &c) {
+                auto &selection = selection_of(p);
+                p.each_selected_cell(selection, [&](const myseq::Cell &c) {
                     p.clear_cell(c.position);
                 });
+                selection.clear();
                 SET_DIRTY_PUSH_UNDO("delete");
             } else if (key_pressed(ImGuiKey_A)) {
-                p.each_cell([&](const myseq::Cell &c) {
-                    p.set_selected(c.position, true);
-                });
-                SET_DIRTY();
+                p.select_all(selection_of(p));
             } else if (key_pressed(ImGuiKey_Y) || key_pressed(ImGuiKey_C)) {
                 grid_copy(p);
             } else if (key_pressed(ImGuiKey_Z)) {
@@ -462,7 +499,7 @@ START_NAMESPACE_DISTRHO
                     SET_DIRTY();
                 }
             } else if (key_pressed_re(ImGuiKey_Escape)) {
-                p.deselect_all();
+                selection_of(p).clear();
             } else {
                 const int updown = shift_held ? 12 : 1;
                 // For some reason CTRL+A makes A stuck
@@ -474,7 +511,7 @@ START_NAMESPACE_DISTRHO
                         + (key_pressed(ImGuiKey_RightArrow) ? 1 : 0);
                 const V2i d(dx, dy);
                 if (d != V2i(0, 0)) {
-                    p.move_selected_cells(d);
+                    p.move_selected_cells(selection_of(p), d);
                     SET_DIRTY_PUSH_UNDO("keyboard move");
                 }
             }
@@ -625,7 +662,7 @@ START_NAMESPACE_DISTRHO
                         }
                     } else {
                         if (previous_move_offset != V2i(0, 0)) {
-                            p.move_selected_cells(previous_move_offset);
+                            p.move_selected_cells(selection_of(p), previous_move_offset);
                             SET_DIRTY_PUSH_UNDO("MovingCells");
                         }
                         interaction = Interaction::None;
@@ -644,46 +681,45 @@ START_NAMESPACE_DISTRHO
                                 sr.cell_max.x, sr.cell_max.y);
                     } else {
                         const auto sr = selection_rectangle(p, mpos, grid_cpos, grid_size, cell_size);
-                        p.deselect_all();
+                        auto &selection = selection_of(p);
+                        selection.clear();
                         d_debug("cell_min.x %d cell_min.y %d cell_max.x %d cell_max.y %d", sr.cell_min.x, sr.cell_min.y,
                                 sr.cell_max.x, sr.cell_max.y);
                         for (int x = sr.cell_min.x; x <= sr.cell_max.x; x++)
                             for (int y = sr.cell_min.y; y <= sr.cell_max.y; y++) {
                                 const auto v = V2i(x, y);
-                                p.set_selected(v, true);
+                                p.set_selected(selection, v, true);
                             }
 
                         interaction = Interaction::None;
-                        SET_DIRTY();
                     }
                     break;
                 case Interaction::DragSelectingCells:
                     if (ImGui::IsMouseDown(ImGuiMouseButton_Right)) {
                         if (ImGui::IsMouseDragging(ImGuiMouseButton_Right)) {
                             if (cursor_hovers_grid) {
-                                p.set_selected(mcell, !drag_started_selected);
-                                SET_DIRTY();
+                                p.set_selected(selection_of(p), mcell, !drag_started_selected);
                             }
                         }
                     } else {
                         interaction = Interaction::None;
-                        SET_DIRTY();
                     }
 
                 case Interaction::None:
                     if (ImGui::IsMouseClicked(ImGuiMouseButton_Right)) {
                         if (cursor_hovers_grid) {
                             if (cursor_hovers_active_cell) {
-                                drag_started_selected = p.get_selected(mcell);
-                                p.set_selected(mcell, !drag_started_selected);
+                                auto &selection = selection_of(p);
+                                drag_started_selected = p.get_selected(selection, mcell);
+                                p.set_selected(selection, mcell, !drag_started_selected);
                                 interaction = Interaction::DragSelectingCells;
                             } else {
                                 drag_started_mpos = mpos;
                                 interaction = Interaction::RectSelectingCells;
                                 p.cursor.x = mcell.x;
                                 p.cursor.y = mcell.y;
+                                SET_DIRTY();
                             }
-                            SET_DIRTY();
                         }
                     } else if (ImGui::IsMouseClicked(ImGuiMouseButton_Left)) {
                         if (cursor_hovers_grid) {
@@ -703,7 +739,7 @@ START_NAMESPACE_DISTRHO
                 return;
             }
 
-            if (p.get_selected(mcell)) {
+            if (p.get_selected(selection_of(p), mcell)) {
                 start_moving_cells(p, mcell, mpos);
             } else {
                 start_drawing_cells(dirty, p, mcell, mpos);
@@ -714,7 +750,7 @@ START_NAMESPACE_DISTRHO
             interaction = Interaction::DrawingCells;
             drag_started_active = p.is_active(mcell);
             p.set_active(mcell, !drag_started_active);
-            p.deselect_all();
+            selection_of(p).clear();
             SET_DIRTY();
         }
 
@@ -723,7 +759,7 @@ START_NAMESPACE_DISTRHO
             drag_started_cell = mcell;
             previous_move_offset = V2i(0, 0);
             moving_cells_set.clear();
-            p.each_selected_cell([&](const myseq::Cell &c) {
+            p.each_selected_cell(selection_of(p), [&](const myseq::Cell &c) {
                 moving_cells_set.insert(c.position);
             });
             interaction = Interaction::MovingCells;
@@ -736,9 +772,9 @@ START_NAMESPACE_DISTRHO
         }
 
         void start_adjusting_velocity(myseq::Pattern &p, const V2i &mcell, const ImVec2 &mpos) {
-            if (p.num_selected() > 0) {
+            if (!selection_of(p).empty()) {
                 drag_started_velocity_vec.clear();
-                p.each_selected_cell([&](const myseq::Cell &c) {
+                p.each_selected_cell(selection_of(p), [&](const myseq::Cell &c) {
                     drag_started_velocity_vec.push_back({c.position, c.velocity});
                 });
                 interaction = Interaction::AdjustingVelocitySelected;
@@ -816,6 +852,7 @@ START_NAMESPACE_DISTRHO
             auto grid_height = ImGui::GetContentRegionAvail().y;
             const auto grid_size = ImVec2(grid_width, grid_height) - ImGui::GetStyle().FramePadding * 2.0;
             auto &p = state.get_selected_pattern();
+            auto &selection = selection_of(p);
             const auto cursor_before = p.cursor;
 
             grid_viewport_mouse_pan();
@@ -880,7 +917,7 @@ START_NAMESPACE_DISTRHO
                     auto p_max =
                             p_min + ImVec2(cell_size.x * (float) (len > 1 ? len : 1), cell_size.y) - cell_padding_xy;
                     auto vel = p.get_velocity(loop_cell);
-                    auto sel = p.get_selected(loop_cell);
+                    auto sel = p.get_selected(selection, loop_cell);
                     skip[i] = len - 1;
                     auto has_cursor = p.cursor == loop_cell;
                     auto has_mouse = mcell == loop_cell;
@@ -958,13 +995,12 @@ START_NAMESPACE_DISTRHO
                     if (is_active && has_mouse && ImGui::BeginTooltip()) {
                         // V2i position;
                         // uint8_t velocity;
-                        // bool selected;
                         // int length;
                         std::ostringstream oss;
-                        const auto &c = p.get_cell_const_ref(loop_cell);
+                        const auto c = p.get_cell(loop_cell);
                         oss << "position: " << c.position.x << ":" << c.position.y << "\n";
                         oss << "velocity: " << (int) c.velocity << "\n";
-                        oss << "selected: " << c.selected << "\n";
+                        oss << "selected: " << p.get_selected(selection, loop_cell) << "\n";
                         oss << "length: " << c.length << "\n";
                         ImGui::TextUnformatted(oss.str().c_str());
                         //ImGui::PushTextWrapPos("He"
@@ -1016,26 +1052,41 @@ START_NAMESPACE_DISTRHO
         }
 
         void read_state_file() {
-            const auto new_state = myseq::State::read_from_file(filename->c_str());
-            if (new_state.has_value()) {
-                state = new_state.value();
+            const auto content = read_file(filename->c_str());
+            if (content.has_value()) {
+                state = myseq::State::from_string(*content);
+                state_file_format = myseq::State::file_format_of(*content);
+                // the same ids are other patterns now
+                selections.clear();
+                decoder.start(state);
+                undo_history.reset(state);
+                loaded_hash = state.content_hash();
+                undo_log.open(filename.value(), loaded_hash, undo_history);
             } else {
+                state_file_format = myseq::State::file_format_for_name(filename->c_str());
                 d_debug("could not read %s", filename->c_str());
             }
         }
 
         void write_state_file() {
-            state.write_to_file(filename->c_str());
+            state.write_file_content(state_file_format, state_file_content);
+            write_file(filename->c_str(), state_file_content.data(), state_file_content.size());
+            undo_log.write(undo_history, state.content_hash());
         }
 
         void uiFileBrowserSelected(const char *new_filename) override {
             if (nullptr == new_filename)
                 return;
-            filename = {std::string(new_filename)};
             if (file_browser_saving) {
+                // the whole history goes with the project to its new place
+                undo_log.load(undo_history);
+                filename = {std::string(new_filename)};
+                state_file_format = myseq::State::file_format_for_name(new_filename);
+                undo_log.create(filename.value(), undo_history);
                 settings_imgui_to_state();
                 write_state_file();
             } else {
+                filename = {std::string(new_filename)};
                 read_state_file();
                 settings_state_to_imgui();
                 publish();
@@ -1086,19 +1137,20 @@ START_NAMESPACE_DISTRHO
                     // first_note
                     ImGui::TableNextColumn();
                     ImGui::PushID(id);
-                    myseq::Pattern &tmp = state.get_pattern(id);
                     ImGui::PushID(1);
-                    const auto new_first_note = note_select(tmp.get_first_note());
-                    if (tmp.get_first_note() != new_first_note) {
+                    // non-const access would decode every pattern the table shows
+                    const auto new_first_note = note_select(pp.get_first_note());
+                    if (pp.get_first_note() != new_first_note) {
                         auto note_count = std::min(16, 127 - new_first_note);
-                        tmp.set_note_trigger_range(new_first_note, note_count);
+                        state.get_pattern(id).set_note_trigger_range(new_first_note, note_count);
                         SET_DIRTY_PUSH_UNDO("first_note")
                     }
                     ImGui::PopID();
                     ImGui::PopID();
 
                     ImGui::TableNextColumn();
-                    ImGui::Text("%s - %s", ALL_NOTES[tmp.get_first_note()], ALL_NOTES[tmp.get_last_note()]);
+                    const auto &shown = std::as_const(state).get_pattern(id);
+                    ImGui::Text("%s - %s", ALL_NOTES[shown.get_first_note()], ALL_NOTES[shown.get_last_note()]);
                 });
                 ImGui::EndTable();
             }
@@ -1131,6 +1183,8 @@ START_NAMESPACE_DISTRHO
             }
             ImGui::SameLine();
             if (ImGui::Button("Delete")) {
+                // a pattern created later may get the id again
+                selections.erase(state.get_selected_id());
                 state.delete_pattern(state.get_selected_id());
                 SET_DIRTY_PUSH_UNDO("delete pattern");
             }
@@ -1150,8 +1204,8 @@ START_NAMESPACE_DISTRHO
         void show_pattern_controls(bool &dirty) {
             auto &p = state.get_selected_pattern();
             int pattern_width_slider_value = p.width;
-            if (ImGui::SliderInt("steps", &pattern_width_slider_value, 1, 32, nullptr,
-                                 ImGuiSliderFlags_None)) {
+            if (ImGui::SliderInt("steps", &pattern_width_slider_value, 1, myseq::Pattern::MAX_WIDTH, nullptr,
+                                 ImGuiSliderFlags_Logarithmic)) {
                 p.resize_width(pattern_width_slider_value);
                 SET_DIRTY_PUSH_UNDO("resize_width");
             }
@@ -1185,7 +1239,7 @@ START_NAMESPACE_DISTRHO
                 SET_DIRTY_PUSH_UNDO("default_velocity");
             }
             if (ImGui::Button("select row")) {
-                p.select_row();
+                p.select_row(selection_of(p));
             }
         }
 
@@ -1204,6 +1258,7 @@ START_NAMESPACE_DISTRHO
         void onImGuiDisplay() override {
 
             bool dirty = false;
+            decoder.adopt(state);
             ImGui::SetNextWindowSize(
                     ImVec2((float) visible_columns * get_cell_size().x + 4.0f * ImGui::GetStyle().ItemSpacing.x, 640), ImGuiCond_FirstUseEver);
             general_keyboard_interaction(dirty);
@@ -1259,10 +1314,25 @@ START_NAMESPACE_DISTRHO
                 ImGui::Text("tp.bbt.beatType: %f", tp.bbt.beatType);
                 ImGui::Text("tp.bbt.ticksPerBeat: %f", tp.bbt.ticksPerBeat);
                 ImGui::Text("tp.bbt.beatsPerMinute: %f", tp.bbt.beatsPerMinute);
+                ImGui::Text("undo: %zu/%zu entries, %.1f KB", undo_history.get_position(), undo_history.size(),
+                            (double) undo_history.bytes() / 1024.0);
+                int budget_mb = (int) (undo_history.get_budget_bytes() / (1024 * 1024));
+                if (ImGui::SliderInt("undo budget MB", &budget_mb, 1, 256)) {
+                    undo_history.set_budget_bytes((std::size_t) budget_mb * 1024 * 1024);
+                }
+                ImGui::Text("undo: %zu ops, log %s", undo_history.ops(), undo_log.is_open() ? "open" : "closed");
+                int max_ops = (int) undo_history.get_max_ops();
+                if (ImGui::SliderInt("undo max ops", &max_ops, 100, 1000000, "%d", ImGuiSliderFlags_Logarithmic)) {
+                    undo_history.set_max_ops((std::size_t) max_ops);
+                }
                 if (ImGui::BeginListBox("undo", ImVec2(-FLT_MIN, 100.0))) {
-                    for (const auto &item : undo_stack) {
-                        ImGui::Selectable(item.descr.c_str(), false);
-                    }
+                    std::size_t i = 0;
+                    undo_history.each_entry([&](const myseq::UndoHistory::Entry &entry) {
+                        // entries that can be redone are greyed out
+                        ImGui::BeginDisabled(i++ >= undo_history.get_position());
+                        ImGui::Selectable(entry.descr.c_str(), false);
+                        ImGui::EndDisabled();
+                    });
                     ImGui::EndListBox();
                 }
             }
@@ -1276,10 +1346,21 @@ START_NAMESPACE_DISTRHO
         void stateChanged(const char *key, const char *value) override {
             d_debug("PluginUI: stateChanged key=%s", key);
             if (std::strcmp(key, "pattern") == 0) {
-                state = myseq::State::from_json_string(value);
+                state = myseq::State::from_string(value, std::strlen(value));
+                selections.clear();
+                decoder.start(state);
+                // this is what the plugin has
+                published_hash = state.content_hash();
+                published_settings = state.settings;
+                undo_history.reset(state);
+                loaded_hash = state.content_hash();
+                if (filename.has_value()) {
+                    undo_log.open(filename.value(), loaded_hash, undo_history);
+                }
                 settings_state_to_imgui();
             } else if (std::strcmp(key, "filename") == 0) {
                 filename = value;
+                undo_log.open(filename.value(), loaded_hash, undo_history);
             }
         }
         // ----------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,292 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+// Headless renderer: plays a project through Player block by block, without a host,
+// and writes what the plugin would have sent as a Standard MIDI File.
+//
+//   MySeq-render <project> <transport.txt> <out.mid>
+//
+// The project is a state file as the plugin saves it, JSON or binary. The transport script has one
+// command per line, times are in beats from the start and # starts a comment:
+//
+//   sample_rate 48000          default 48000
+//   block_size 256             default 256
+//   bpm 120                    default 120
+//   beats_per_bar 4            default 4
+//   ticks_per_beat 1920        default 1920, also the division of the MIDI file
+//   play <beat>                transport rolls from here; without any play it rolls from the start
+//   stop <beat>
+//   note_on <beat> <note> <velocity> [channel]
+//   note_off <beat> <note> [channel]
+//   end <beat>                 length of the render, default is one beat after the last command
+//
+// Like from most hosts, transport changes are seen at the start of the block they fall into.
+//
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Patterns.hpp"
+#include "Player.hpp"
+#include "MidiOutBuffer.hpp"
+#include "TimePositionCalc.hpp"
+#include "Utils.hpp"
+
+namespace {
+
+    struct ScriptEvent {
+        enum class Type {
+            Play,
+            Stop,
+            Note,
+        };
+        double beat;
+        Type type;
+        uint8_t data[4];
+    };
+
+    struct Script {
+        double sample_rate = 48000.0;
+        uint32_t block_size = 256;
+        double bpm = 120.0;
+        float beats_per_bar = 4.0f;
+        double ticks_per_beat = 1920.0;
+        double end = -1.0;
+        bool has_play = false;
+        std::vector<ScriptEvent> events;
+    };
+
+    struct RenderedEvent {
+        uint64_t frame;
+        uint8_t status;
+        uint8_t note;
+        uint8_t velocity;
+    };
+
+    [[noreturn]] void fail(const char *what, int line_number, const std::string &line) {
+        fprintf(stderr, "transport script line %d: %s: %s\n", line_number, what, line.c_str());
+        exit(1);
+    }
+
+    Script parse_script(const std::string &text) {
+        Script script;
+        std::istringstream lines(text);
+        std::string line;
+        int line_number = 0;
+        while (std::getline(lines, line)) {
+            line_number++;
+            const auto comment = line.find('#');
+            std::istringstream in(line.substr(0, comment));
+            std::string command;
+            if (!(in >> command)) {
+                continue;
+            }
+            double beat = 0.0;
+            if (command == "sample_rate") {
+                in >> script.sample_rate;
+            } else if (command == "block_size") {
+                in >> script.block_size;
+            } else if (command == "bpm") {
+                in >> script.bpm;
+            } else if (command == "beats_per_bar") {
+                in >> script.beats_per_bar;
+            } else if (command == "ticks_per_beat") {
+                in >> script.ticks_per_beat;
+            } else if (command == "end") {
+                in >> script.end;
+            } else if (command == "play" || command == "stop") {
+                in >> beat;
+                const auto type = command == "play" ? ScriptEvent::Type::Play : ScriptEvent::Type::Stop;
+                script.events.push_back({beat, type, {}});
+                script.has_play |= type == ScriptEvent::Type::Play;
+            } else if (command == "note_on" || command == "note_off") {
+                int note = 0;
+                int velocity = 0;
+                int channel = 0;
+                in >> beat >> note;
+                if (command == "note_on") {
+                    in >> velocity;
+                }
+                if (!in.fail() && !(in >> channel)) {
+                    channel = 0;
+                    in.clear();
+                }
+                if (note < 0 || note > 127 || velocity < 0 || velocity > 127 || channel < 0 || channel > 15) {
+                    fail("note, velocity or channel out of range", line_number, line);
+                }
+                const auto status = (command == "note_on" ? 0x90 : 0x80) | channel;
+                script.events.push_back({beat, ScriptEvent::Type::Note,
+                                         {(uint8_t) status, (uint8_t) note, (uint8_t) velocity, 0}});
+            } else {
+                fail("unknown command", line_number, line);
+            }
+            if (in.fail()) {
+                fail("bad arguments", line_number, line);
+            }
+        }
+        if (script.sample_rate <= 0.0 || script.block_size == 0 || script.bpm <= 0.0 || script.beats_per_bar <= 0.0f
+            || script.ticks_per_beat <= 0.0 || script.ticks_per_beat >= 32768.0) {
+            fail("bad settings", line_number, "");
+        }
+        std::stable_sort(script.events.begin(), script.events.end(), [](const ScriptEvent &a, const ScriptEvent &b) {
+            return a.beat < b.beat;
+        });
+        if (script.end < 0.0) {
+            script.end = (script.events.empty() ? 0.0 : script.events.back().beat) + 1.0;
+        }
+        return script;
+    }
+
+    TimePosition time_position(const Script &script, uint64_t frame, bool playing) {
+        const double frames_per_beat = script.sample_rate * 60.0 / script.bpm;
+        const double beat = (double) frame / frames_per_beat;
+        const double bar = std::floor(beat / script.beats_per_bar);
+        const double beat_in_bar = beat - bar * script.beats_per_bar;
+        TimePosition t;
+        t.playing = playing;
+        t.frame = frame;
+        t.bbt.valid = true;
+        t.bbt.bar = (int32_t) bar + 1;
+        t.bbt.beat = (int32_t) std::floor(beat_in_bar) + 1;
+        t.bbt.tick = (beat_in_bar - std::floor(beat_in_bar)) * script.ticks_per_beat;
+        t.bbt.barStartTick = bar * script.beats_per_bar * script.ticks_per_beat;
+        t.bbt.beatsPerBar = script.beats_per_bar;
+        t.bbt.beatType = 4.0f;
+        t.bbt.ticksPerBeat = script.ticks_per_beat;
+        t.bbt.beatsPerMinute = script.bpm;
+        return t;
+    }
+
+    void put_var_len(std::string &out, uint32_t value) {
+        uint8_t bytes[5];
+        int n = 0;
+        do {
+            bytes[n++] = value & 0x7f;
+            value >>= 7;
+        } while (value > 0);
+        while (n > 0) {
+            n--;
+            out.push_back((char) (bytes[n] | (n > 0 ? 0x80 : 0x00)));
+        }
+    }
+
+    void put_be(std::string &out, uint32_t value, int bytes) {
+        for (int i = bytes - 1; i >= 0; i--) {
+            out.push_back((char) ((value >> (8 * i)) & 0xff));
+        }
+    }
+
+    // Format 0 file with the tempo of the script and the events in its ticks
+    std::string to_midi_file(const Script &script, const std::vector<RenderedEvent> &events) {
+        const double frames_per_beat = script.sample_rate * 60.0 / script.bpm;
+        std::string track;
+        put_var_len(track, 0);
+        track += "\xff\x51\x03";
+        put_be(track, (uint32_t) std::lround(60000000.0 / script.bpm), 3);
+        uint64_t last_tick = 0;
+        for (const auto &e: events) {
+            const auto tick = std::max(last_tick, (uint64_t) std::llround(
+                    (double) e.frame * script.ticks_per_beat / frames_per_beat));
+            put_var_len(track, (uint32_t) (tick - last_tick));
+            track.push_back((char) e.status);
+            track.push_back((char) e.note);
+            track.push_back((char) e.velocity);
+            last_tick = tick;
+        }
+        put_var_len(track, 0);
+        track += std::string("\xff\x2f\x00", 3);
+
+        std::string file = "MThd";
+        put_be(file, 6, 4);
+        put_be(file, 0, 2);
+        put_be(file, 1, 2);
+        put_be(file, (uint32_t) script.ticks_per_beat, 2);
+        file += "MTrk";
+        put_be(file, (uint32_t) track.size(), 4);
+        file += track;
+        return file;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <project> <transport.txt> <out.mid>\n", argv[0]);
+        return 2;
+    }
+    const auto project = read_file(argv[1]);
+    const auto script_text = read_file(argv[2]);
+    if (!project.has_value() || !script_text.has_value()) {
+        fprintf(stderr, "could not read %s\n", project.has_value() ? argv[2] : argv[1]);
+        return 1;
+    }
+    auto state = myseq::State::from_string(*project);
+    // the player reads patterns that are still encoded as empty
+    state.decode_all();
+    const auto script = parse_script(script_text.value());
+
+    const double frames_per_beat = script.sample_rate * 60.0 / script.bpm;
+    const auto total_frames = (uint64_t) std::ceil(script.end * frames_per_beat);
+    myseq::Player player;
+    myseq::MidiOutBuffer midi_out;
+    std::vector<RenderedEvent> rendered;
+    std::vector<std::pair<uint32_t, myseq::NoteMessage>> block_input;
+    bool playing = !script.has_play;
+    std::size_t next_event = 0;
+    int iteration = 0;
+
+    const auto started = std::chrono::steady_clock::now();
+    for (uint64_t frame = 0; frame < total_frames; frame += script.block_size) {
+        const auto frames = (uint32_t) std::min<uint64_t>(script.block_size, total_frames - frame);
+        block_input.clear();
+        while (next_event < script.events.size()
+               && script.events[next_event].beat * frames_per_beat < (double) (frame + frames)) {
+            const auto &e = script.events[next_event++];
+            switch (e.type) {
+                case ScriptEvent::Type::Play:
+                    playing = true;
+                    break;
+                case ScriptEvent::Type::Stop:
+                    playing = false;
+                    break;
+                case ScriptEvent::Type::Note: {
+                    const auto at = std::llround(e.beat * frames_per_beat) - (long long) frame;
+                    const auto msg = myseq::NoteMessage::parse(e.data);
+                    if (msg.has_value()) {
+                        block_input.emplace_back((uint32_t) std::max(0LL, std::min<long long>(at, frames - 1)),
+                                                 msg.value());
+                    }
+                    break;
+                }
+            }
+        }
+
+        const myseq::TimePositionCalc tc(time_position(script, frame, playing), script.sample_rate);
+        const auto tp = myseq::TimeParams::from_time_position(tc, frames, iteration);
+        player.handle_input(state, [&](auto f) {
+            for (const auto &input: block_input) {
+                f(input.second, tp.time + (input.first / tc.frames_per_tick()));
+            }
+        }, tp);
+        player.run([&](uint8_t note, uint8_t velocity, double time) {
+            midi_out.push(myseq::block_frame(time, tc.frames_per_tick(), frames), note, velocity);
+        }, state, tp);
+        midi_out.finish_block();
+        midi_out.write([&](const myseq::MidiOutEvent &e) {
+            rendered.push_back({frame + e.frame, (uint8_t) (e.velocity == 0 ? 0x80 : 0x90), e.note, e.velocity});
+            return true;
+        });
+        iteration++;
+    }
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    const auto file = to_midi_file(script, rendered);
+    write_file(argv[3], file.data(), file.size());
+    printf("%d blocks, %zu events, %.3f s of audio rendered in %.3f ms, %.0f blocks/sec\n",
+           iteration, rendered.size(), (double) total_frames / script.sample_rate, elapsed * 1000.0,
+           elapsed > 0.0 ? iteration / elapsed : 0.0);
+    return 0;
+}
@@ -0,0 +1,90 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#include "RtAllocGuard.hpp"
+
+#ifdef MYSEQ_RT_ALLOC_GUARD
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <cpptrace/cpptrace.hpp>
+
+namespace {
+    thread_local int rt_depth = 0;
+
+    void check_rt(const char *what, std::size_t size) {
+        if (rt_depth > 0) {
+            // generating the trace allocates, so leave real-time mode first
+            rt_depth = 0;
+            fprintf(stderr, "RtAllocGuard: %s (%zu bytes) called from the audio thread\n", what, size);
+            cpptrace::generate_trace().print();
+            abort();
+        }
+    }
+
+    void *checked_alloc(std::size_t size) {
+        check_rt("operator new", size);
+        void *p = std::malloc(size == 0 ? 1 : size);
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    void checked_free(void *p) {
+        if (p != nullptr) {
+            check_rt("operator delete", 0);
+            std::free(p);
+        }
+    }
+}
+
+namespace myseq {
+    RtAllocGuard::RtAllocGuard() {
+        rt_depth++;
+    }
+
+    RtAllocGuard::~RtAllocGuard() {
+        if (rt_depth > 0) {
+            rt_depth--;
+        }
+    }
+}
+
+void *operator new(std::size_t size) {
+    return checked_alloc(size);
+}
+
+void *operator new[](std::size_t size) {
+    return checked_alloc(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    check_rt("operator new", size);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    check_rt("operator new[]", size);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void *p) noexcept {
+    checked_free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    checked_free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    checked_free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept {
+    checked_free(p);
+}
+
+#endif // MYSEQ_RT_ALLOC_GUARD
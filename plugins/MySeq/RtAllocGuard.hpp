@@ -0,0 +1,33 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_RTALLOCGUARD_HPP
+#define MY_PLUGINS_RTALLOCGUARD_HPP
+
+namespace myseq {
+
+    // While an RtAllocGuard is alive on a thread, any operator new/delete called on that thread
+    // prints a stack trace and aborts. Only active in builds made with RT_ALLOC_GUARD=true,
+    // otherwise it compiles to nothing.
+    // Plain malloc/free calls are not intercepted, only C++ allocations (containers, strings, etc).
+    // Plugin formats loaded into a host that provides its own operator new may bypass the check,
+    // the standalone JACK build always goes through it.
+#ifdef MYSEQ_RT_ALLOC_GUARD
+    struct RtAllocGuard {
+        RtAllocGuard();
+
+        ~RtAllocGuard();
+
+        RtAllocGuard(const RtAllocGuard &) = delete;
+
+        RtAllocGuard &operator=(const RtAllocGuard &) = delete;
+    };
+#else
+    struct RtAllocGuard {
+    };
+#endif
+
+}
+
+#endif //MY_PLUGINS_RTALLOCGUARD_HPP
@@ -0,0 +1,102 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_SNAPSHOTHANDOFF_HPP
+#define MY_PLUGINS_SNAPSHOTHANDOFF_HPP
+
+#include <atomic>
+#include <memory>
+#include "MyAssert.hpp"
+
+namespace myseq {
+
+    // Hands immutable snapshots from a non-realtime thread to the audio thread without locks.
+    //
+    // publish() and collect() are called from non-realtime threads, acquire() from the audio thread
+    // at the start of a block. The audio thread never deletes: a snapshot it stops using is parked in
+    // the retired slot and deleted by the next collect(). While that slot is occupied acquire()
+    // keeps using the current snapshot, so at most three snapshots exist at any time.
+    template<typename T>
+    class SnapshotHandoff {
+        std::atomic<T *> pending{nullptr};
+        std::atomic<T *> retired{nullptr};
+        // owned by the audio thread
+        T *current;
+
+    public:
+        explicit SnapshotHandoff(std::unique_ptr<T> initial) : current(initial.release()) {}
+
+        ~SnapshotHandoff() {
+            delete pending.exchange(nullptr);
+            delete retired.exchange(nullptr);
+            delete current;
+        }
+
+        SnapshotHandoff(const SnapshotHandoff &) = delete;
+
+        SnapshotHandoff &operator=(const SnapshotHandoff &) = delete;
+
+        void publish(std::unique_ptr<T> next) {
+            publish(std::move(next), [] {});
+        }
+
+        // after_collect runs between emptying the retired slot and handing over next,
+        // so that tests can have the audio thread retire a snapshot right there
+        template<typename F>
+        void publish(std::unique_ptr<T> next, F after_collect) {
+            collect();
+            after_collect();
+            // a snapshot that was never picked up was not seen by the audio thread, safe to delete here
+            delete pending.exchange(next.release(), std::memory_order_acq_rel);
+            // an acquire() since the first collect() may have retired a snapshot, and would refuse next
+            // until the slot is empty. One that retires after this collect() takes next, since acquire()
+            // retires before it takes the pending snapshot
+            collect();
+        }
+
+        void collect() {
+            delete retired.exchange(nullptr, std::memory_order_acq_rel);
+        }
+
+        T &acquire() {
+            return acquire([] {});
+        }
+
+        // after_retire runs between retiring the current snapshot and taking the pending one,
+        // so that tests can have a whole publish() happen right there
+        template<typename F>
+        T &acquire(F after_retire) {
+            // Retire before taking: when this takes a snapshot older than one being published, the retired
+            // slot is already filled when that publish() collects after its exchange, so it is emptied.
+            // Only acquire() empties pending, so it is still set at the exchange
+            if (retired.load(std::memory_order_acquire) == nullptr &&
+                pending.load(std::memory_order_acquire) != nullptr) {
+                retired.store(current, std::memory_order_release);
+                after_retire();
+                current = pending.exchange(nullptr, std::memory_order_acq_rel);
+            }
+            return *current;
+        }
+    };
+
+    inline void test_snapshot_handoff() {
+        SnapshotHandoff<int> handoff(std::make_unique<int>(0));
+        handoff.publish(std::make_unique<int>(1));
+        // the audio thread picks up 1 while 2 is being published
+        handoff.publish(std::make_unique<int>(2), [&]() {
+            assert(handoff.acquire() == 1);
+        });
+        assert(handoff.acquire() == 2);
+        handoff.publish(std::make_unique<int>(3));
+        // 4 is published while the audio thread is between retiring 2 and taking 3
+        assert(handoff.acquire([&]() {
+            handoff.publish(std::make_unique<int>(4));
+        }) == 4);
+        // and nothing is left in the retired slot to hold back the next one
+        handoff.publish(std::make_unique<int>(5));
+        assert(handoff.acquire() == 5);
+    }
+}
+
+#endif //MY_PLUGINS_SNAPSHOTHANDOFF_HPP
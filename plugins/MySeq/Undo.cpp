@@ -0,0 +1,656 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include "rapidjson/document.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+#include "Utils.hpp"
+#include "Undo.hpp"
+
+namespace myseq {
+
+    namespace {
+
+        bool only_view_changes(const std::vector<EditOp> &ops) {
+            return std::all_of(ops.begin(), ops.end(), [](const EditOp &op) {
+                return op.type == EditOp::Type::SetCursor || op.type == EditOp::Type::SetViewport;
+            });
+        }
+
+        using JsonWriter = rapidjson::Writer<rapidjson::StringBuffer>;
+
+        constexpr int OP_FIELDS = 10;
+
+        // [type, flag, pattern_id, x, y, a, b, speed, viewport.x, viewport.y] without the trailing zeros
+        void write_op(JsonWriter &w, const EditOp &op) {
+            const double fields[OP_FIELDS] = {(double) op.type, (double) op.flag, (double) op.pattern_id,
+                                              (double) op.x, (double) op.y, (double) op.a, (double) op.b,
+                                              op.speed, op.viewport_x, op.viewport_y};
+            int n = OP_FIELDS;
+            while (n > 0 && fields[n - 1] == 0.0) {
+                n--;
+            }
+            w.StartArray();
+            for (int i = 0; i < n; i++) {
+                if (i < 7) {
+                    w.Int((int) fields[i]);
+                } else {
+                    w.Double(fields[i]);
+                }
+            }
+            w.EndArray();
+        }
+
+        bool read_op(const rapidjson::Value &value, EditOp &op) {
+            if (!value.IsArray() || value.Size() > OP_FIELDS) {
+                return false;
+            }
+            double fields[OP_FIELDS] = {};
+            for (rapidjson::SizeType i = 0; i < value.Size(); i++) {
+                if (!value[i].IsNumber()) {
+                    return false;
+                }
+                fields[i] = value[i].GetDouble();
+            }
+            if (fields[0] < 0 || fields[0] > (double) EditOp::Type::ClearLaneEvent) {
+                return false;
+            }
+            op = {};
+            op.type = (EditOp::Type) fields[0];
+            op.flag = fields[1] != 0.0;
+            op.pattern_id = (int) fields[2];
+            op.x = (int) fields[3];
+            op.y = (int) fields[4];
+            op.a = (int) fields[5];
+            op.b = (int) fields[6];
+            op.speed = (float) fields[7];
+            op.viewport_x = (float) fields[8];
+            op.viewport_y = (float) fields[9];
+            return true;
+        }
+
+        void write_ops(JsonWriter &w, const char *key, const std::vector<EditOp> &ops) {
+            w.Key(key);
+            w.StartArray();
+            for (const auto &op: ops) {
+                write_op(w, op);
+            }
+            w.EndArray();
+        }
+
+        bool read_ops(const rapidjson::Value &value, std::vector<EditOp> &ops) {
+            if (!value.IsArray()) {
+                return false;
+            }
+            ops.resize(value.Size());
+            for (rapidjson::SizeType i = 0; i < value.Size(); i++) {
+                if (!read_op(value[i], ops[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void write_line(rapidjson::StringBuffer &buffer, std::string &out) {
+            out.append(buffer.GetString(), buffer.GetSize());
+            out.push_back('\n');
+        }
+
+        void write_record(const UndoHistory::Record &record, std::string &out) {
+            rapidjson::StringBuffer buffer;
+            JsonWriter w(buffer);
+            w.StartObject();
+            w.Key("e");
+            switch (record.kind) {
+                case UndoHistory::Record::Kind::Push:
+                    w.String("push");
+                    w.Key("d");
+                    w.String(record.entry.descr.c_str(), record.entry.descr.size());
+                    write_ops(w, "f", record.entry.forward);
+                    write_ops(w, "b", record.entry.backward);
+                    break;
+                case UndoHistory::Record::Kind::Pop:
+                    w.String("pop");
+                    break;
+                case UndoHistory::Record::Kind::Undo:
+                    w.String("undo");
+                    break;
+                case UndoHistory::Record::Kind::Redo:
+                    w.String("redo");
+                    break;
+            }
+            w.EndObject();
+            write_line(buffer, out);
+        }
+
+        void write_hash(const char *event, uint64_t project_hash, std::string &out) {
+            rapidjson::StringBuffer buffer;
+            JsonWriter w(buffer);
+            w.StartObject();
+            w.Key("e");
+            w.String(event);
+            w.Key("h");
+            w.Uint64(project_hash);
+            w.EndObject();
+            write_line(buffer, out);
+        }
+
+        struct LogLine {
+            enum class Kind {
+                Opened,
+                Saved,
+                History,
+            };
+            Kind kind;
+            uint64_t hash;
+            UndoHistory::Record record;
+            // of the text after the line
+            std::size_t end;
+        };
+
+        // false for anything this version does not know, including a line cut short by a crash
+        bool read_line(const char *s, std::size_t length, LogLine &line) {
+            rapidjson::Document d;
+            d.Parse(s, length);
+            if (d.HasParseError() || !d.IsObject() || !d.HasMember("e") || !d["e"].IsString()) {
+                return false;
+            }
+            const std::string event = d["e"].GetString();
+            if (event == "open" || event == "save") {
+                if (!d.HasMember("h") || !d["h"].IsUint64()) {
+                    return false;
+                }
+                line.kind = event == "open" ? LogLine::Kind::Opened : LogLine::Kind::Saved;
+                line.hash = d["h"].GetUint64();
+                return true;
+            }
+            line.kind = LogLine::Kind::History;
+            line.record = {};
+            if (event == "push") {
+                if (!d.HasMember("d") || !d["d"].IsString() || !d.HasMember("f") || !d.HasMember("b")) {
+                    return false;
+                }
+                line.record.kind = UndoHistory::Record::Kind::Push;
+                line.record.entry.descr = d["d"].GetString();
+                // never coalesced with what the session pushes
+                line.record.entry.time = -std::numeric_limits<double>::infinity();
+                return read_ops(d["f"], line.record.entry.forward) && read_ops(d["b"], line.record.entry.backward);
+            } else if (event == "pop") {
+                line.record.kind = UndoHistory::Record::Kind::Pop;
+            } else if (event == "undo") {
+                line.record.kind = UndoHistory::Record::Kind::Undo;
+            } else if (event == "redo") {
+                line.record.kind = UndoHistory::Record::Kind::Redo;
+            } else {
+                return false;
+            }
+            return true;
+        }
+
+        std::size_t file_size(const std::string &filename) {
+            std::ifstream in(filename, std::ios::binary | std::ios::ate);
+            return in.good() ? (std::size_t) in.tellg() : 0;
+        }
+    }
+
+    void UndoHistory::apply(const std::vector<EditOp> &ops, State &state) {
+        for (const auto &op: ops) {
+            apply_edit(state, op);
+        }
+    }
+
+    void UndoHistory::enforce_budget() {
+        while ((total_bytes > budget_bytes || total_ops > max_ops) && !entries.empty()) {
+            total_bytes -= entries.front().bytes();
+            total_ops -= entries.front().ops();
+            entries.pop_front();
+            if (position > 0) {
+                position--;
+            }
+        }
+    }
+
+    void UndoHistory::drop_redo_entries() {
+        while (entries.size() > position) {
+            total_bytes -= entries.back().bytes();
+            total_ops -= entries.back().ops();
+            entries.pop_back();
+        }
+    }
+
+    void UndoHistory::add_entry(Entry &&entry) {
+        drop_redo_entries();
+        if (journaling) {
+            journal.push_back({Record::Kind::Push, entry});
+        }
+        total_bytes += entry.bytes();
+        total_ops += entry.ops();
+        entries.push_back(std::move(entry));
+        position++;
+        enforce_budget();
+    }
+
+    void UndoHistory::remove_last_entry() {
+        drop_redo_entries();
+        if (journaling) {
+            journal.push_back({Record::Kind::Pop, {}});
+        }
+        if (!entries.empty()) {
+            total_bytes -= entries.back().bytes();
+            total_ops -= entries.back().ops();
+            entries.pop_back();
+            position--;
+        }
+    }
+
+    void UndoHistory::reset(const State &state) {
+        recorded = state;
+        drop_entries();
+        journal.clear();
+    }
+
+    void UndoHistory::drop_entries() {
+        entries.clear();
+        position = 0;
+        total_bytes = 0;
+        total_ops = 0;
+    }
+
+    void UndoHistory::replay(const Record &record) {
+        switch (record.kind) {
+            case Record::Kind::Push:
+                add_entry(Entry(record.entry));
+                break;
+            case Record::Kind::Pop:
+                remove_last_entry();
+                break;
+            case Record::Kind::Undo:
+                if (can_undo()) {
+                    position--;
+                }
+                break;
+            case Record::Kind::Redo:
+                if (can_redo()) {
+                    position++;
+                }
+                break;
+        }
+    }
+
+    void UndoHistory::take_entries(UndoHistory &&other) {
+        entries = std::move(other.entries);
+        position = other.position;
+        total_bytes = other.total_bytes;
+        total_ops = other.total_ops;
+        enforce_budget();
+    }
+
+    bool UndoHistory::push(const char *descr, const State &state, double time) {
+        if (state.content_hash() == recorded.content_hash()) {
+            return false;
+        }
+        Entry entry{descr, time, {}, {}};
+        diff_states(recorded, state, entry.forward);
+        if (only_view_changes(entry.forward)) {
+            return false;
+        }
+
+        auto before = recorded;
+        if (position > 0 && entries[position - 1].descr == entry.descr &&
+            time - entries[position - 1].time <= coalesce_seconds) {
+            // one gesture, diff against the state before it started
+            apply(entries[position - 1].backward, before);
+            remove_last_entry();
+            entry.forward.clear();
+            diff_states(before, state, entry.forward);
+        }
+        recorded = state;
+        if (only_view_changes(entry.forward)) {
+            // the gesture ended where it started
+            return false;
+        }
+        diff_states(state, before, entry.backward);
+        entry.forward.shrink_to_fit();
+        entry.backward.shrink_to_fit();
+        add_entry(std::move(entry));
+        return true;
+    }
+
+    bool UndoHistory::undo(State &state) {
+        if (!can_undo()) {
+            return false;
+        }
+        position--;
+        if (journaling) {
+            journal.push_back({Record::Kind::Undo, {}});
+        }
+        apply(entries[position].backward, recorded);
+        const auto settings = state.settings;
+        state = recorded;
+        state.settings = settings;
+        return true;
+    }
+
+    bool UndoHistory::redo(State &state) {
+        if (!can_redo()) {
+            return false;
+        }
+        apply(entries[position].forward, recorded);
+        position++;
+        if (journaling) {
+            journal.push_back({Record::Kind::Redo, {}});
+        }
+        const auto settings = state.settings;
+        state = recorded;
+        state.settings = settings;
+        return true;
+    }
+
+    void UndoLog::write_journal(UndoHistory &history, std::string &out) {
+        history.drain_journal([&](const UndoHistory::Record &record) {
+            write_record(record, out);
+        });
+    }
+
+    void UndoLog::write_entries(const UndoHistory &history, std::string &out) {
+        history.each_entry([&](const UndoHistory::Entry &entry) {
+            write_record({UndoHistory::Record::Kind::Push, entry}, out);
+        });
+        for (auto i = history.get_position(); i < history.size(); i++) {
+            write_record({UndoHistory::Record::Kind::Undo, {}}, out);
+        }
+    }
+
+    void UndoLog::write_opened(uint64_t project_hash, std::string &out) {
+        write_hash("open", project_hash, out);
+    }
+
+    void UndoLog::write_saved(uint64_t project_hash, std::string &out) {
+        write_hash("save", project_hash, out);
+    }
+
+    bool UndoLog::read(const std::string &log, UndoHistory &history, std::string &compacted) {
+        std::vector<LogLine> lines;
+        std::size_t begin = 0;
+        while (begin < log.size()) {
+            auto end = log.find('\n', begin);
+            end = end == std::string::npos ? log.size() : end + 1;
+            LogLine line{};
+            if (read_line(log.data() + begin, end - begin, line)) {
+                line.end = end;
+                lines.push_back(std::move(line));
+            }
+            begin = end;
+        }
+        if (lines.empty()) {
+            return false;
+        }
+
+        // What a session did after its last save never made it into the project file,
+        // the next session starts from that save
+        std::vector<bool> keep(lines.size(), true);
+        std::size_t session = 0;
+        std::optional<std::size_t> last_saved;
+        for (std::size_t i = 0; i < lines.size(); i++) {
+            if (lines[i].kind == LogLine::Kind::Opened) {
+                const auto cut = last_saved.has_value() ? *last_saved + 1
+                                                        : session + (lines[session].kind == LogLine::Kind::Opened);
+                for (auto j = cut; j < i; j++) {
+                    keep[j] = false;
+                }
+                session = i;
+                last_saved.reset();
+            } else if (lines[i].kind == LogLine::Kind::Saved) {
+                last_saved = i;
+            }
+        }
+        // the rest of the current session is copied as it is
+        const auto snapshot_at = last_saved.value_or(session);
+
+        std::optional<uint64_t> saved;
+        for (std::size_t i = 0; i < lines.size(); i++) {
+            const auto &line = lines[i];
+            if (keep[i]) {
+                switch (line.kind) {
+                    case LogLine::Kind::Opened:
+                        if (saved != line.hash) {
+                            // the project was changed without us, the history does not lead to it
+                            history.drop_entries();
+                        }
+                        saved = line.hash;
+                        break;
+                    case LogLine::Kind::Saved:
+                        saved = line.hash;
+                        break;
+                    case LogLine::Kind::History:
+                        history.replay(line.record);
+                        break;
+                }
+            }
+            if (i == snapshot_at) {
+                compacted.clear();
+                if (saved.has_value()) {
+                    write_opened(*saved, compacted);
+                }
+                write_entries(history, compacted);
+                if (saved.has_value()) {
+                    write_saved(*saved, compacted);
+                }
+                compacted.append(log, line.end, std::string::npos);
+            }
+        }
+        return log.size() > 2 * compacted.size();
+    }
+
+    void UndoLog::open(const std::string &project_filename, uint64_t project_hash, UndoHistory &history) {
+        path = project_filename + ".undo";
+        loaded = false;
+        history.set_journaling(true);
+        std::string out;
+        write_opened(project_hash, out);
+        append_file(path.c_str(), out.data(), out.size());
+        if (file_size(path) > COMPACT_BYTES_PER_OP * history.get_max_ops()) {
+            load(history);
+        }
+    }
+
+    void UndoLog::create(const std::string &project_filename, UndoHistory &history) {
+        path = project_filename + ".undo";
+        loaded = true;
+        history.set_journaling(true);
+        std::string out;
+        write_entries(history, out);
+        write_file(path.c_str(), out.data(), out.size());
+    }
+
+    void UndoLog::close(UndoHistory &history) {
+        path.clear();
+        history.set_journaling(false);
+    }
+
+    void UndoLog::write(UndoHistory &history, uint64_t project_hash) {
+        if (!is_open()) {
+            return;
+        }
+        std::string out;
+        write_journal(history, out);
+        write_saved(project_hash, out);
+        append_file(path.c_str(), out.data(), out.size());
+    }
+
+    void UndoLog::load(UndoHistory &history) {
+        if (!is_open() || loaded) {
+            return;
+        }
+        loaded = true;
+        std::string out;
+        write_journal(history, out);
+        append_file(path.c_str(), out.data(), out.size());
+        const auto log = read_file(path.c_str());
+        if (!log.has_value()) {
+            return;
+        }
+        UndoHistory replayed(history.get_budget_bytes(), UndoHistory::DEFAULT_COALESCE_SECONDS, history.get_max_ops());
+        std::string compacted;
+        if (read(log.value(), replayed, compacted)) {
+            write_file(path.c_str(), compacted.data(), compacted.size());
+        }
+        history.take_entries(std::move(replayed));
+    }
+
+    void test_undo() {
+        UndoHistory history(1024 * 1024, 0.5);
+        State state;
+        state.create_pattern();
+        state.set_selected_id(0);
+        history.reset(state);
+        auto &p = state.get_pattern(0);
+
+        // moving the cursor alone is not recorded
+        p.cursor = V2i(3, 3);
+        assert(!history.push("cursor", state, 0.0));
+
+        p.set_velocity(V2i(0, 10), 100);
+        assert(history.push("draw", state, 1.0));
+        state.get_pattern(0).set_velocity(V2i(1, 10), 90);
+        assert(history.push("draw", state, 1.2));
+        // same description within the coalesce window is the same gesture
+        assert(history.size() == 1);
+        state.get_pattern(0).set_velocity(V2i(1, 10), 80);
+        assert(history.push("velocity", state, 1.3));
+        state.create_pattern();
+        assert(history.push("new pattern", state, 5.0));
+        assert(history.size() == 3 && history.get_position() == 3);
+        // a gesture that ends where it started
+        state.get_pattern(1).set_velocity(V2i(2, 2), 50);
+        assert(history.push("draw", state, 5.1));
+        state.get_pattern(1).clear_cell(V2i(2, 2));
+        assert(!history.push("draw", state, 5.2));
+        assert(history.size() == 3);
+
+        const auto end_state = state;
+        assert(history.undo(state));
+        assert(state.num_patterns() == 1 && state.get_pattern(0).get_velocity(V2i(1, 10)) == 80);
+        assert(history.undo(state));
+        assert(state.get_pattern(0).get_velocity(V2i(1, 10)) == 90);
+        assert(history.undo(state));
+        assert(!state.get_pattern(0).exists(V2i(0, 10)) && !state.get_pattern(0).exists(V2i(1, 10)));
+        assert(!history.undo(state));
+
+        assert(history.redo(state) && history.redo(state) && history.redo(state));
+        assert(!history.redo(state));
+        std::vector<EditOp> ops;
+        diff_states(state, end_state, ops);
+        assert(ops.empty());
+
+        // pushing after undo drops the redo entries
+        assert(history.undo(state));
+        state.get_pattern(0).set_length(V2i(0, 10), 4);
+        assert(history.push("length", state, 10.0));
+        assert(!history.can_redo() && history.size() == 3);
+
+        // deleted patterns come back in their place
+        state.create_pattern();
+        history.push("new pattern", state, 11.0);
+        state.delete_pattern(0);
+        history.push("delete pattern", state, 12.0);
+        history.undo(state);
+        assert(state.patterns[0]->id == 0 && state.patterns[1]->id == 1);
+
+        // the budget drops the oldest entries, undo then stops after the dropped one
+        const auto size = history.size();
+        history.set_budget_bytes(history.bytes() - 1);
+        assert(history.size() == size - 1 && history.bytes() <= history.get_budget_bytes());
+        while (history.undo(state)) {}
+        assert(state.get_pattern(0).get_velocity(V2i(0, 10)) == 100 && state.get_pattern(0).get_length(V2i(0, 10)) == 1);
+        assert(state.get_pattern(0).get_velocity(V2i(1, 10)) == 90);
+    }
+
+    void test_undo_log() {
+        UndoHistory history;
+        history.set_journaling(true);
+        State state;
+        state.create_pattern();
+        history.reset(state);
+        const auto start = state;
+        std::string log;
+        UndoLog::write_opened(1, log);
+
+        state.get_pattern(0).set_velocity(V2i(0, 3), 100);
+        state.get_pattern(0).set_speed(0.25f);
+        history.push("draw", state, 0.0);
+        state.get_pattern(0).set_velocity(V2i(1, 3), 90);
+        history.push("draw", state, 0.1);
+        state.create_pattern();
+        history.push("new pattern", state, 1.0);
+        state.get_pattern(1).set_velocity(V2i(5, 5), 10);
+        history.push("draw", state, 2.0);
+        history.undo(state);
+        UndoLog::write_journal(history, log);
+        UndoLog::write_saved(2, log);
+        const auto saved_state = state;
+
+        // the next session opens what was saved, the history leads back to the start
+        UndoLog::write_opened(2, log);
+        UndoHistory next;
+        next.reset(saved_state);
+        UndoHistory replayed;
+        std::string compacted;
+        UndoLog::read(log, replayed, compacted);
+        next.take_entries(std::move(replayed));
+        assert(next.size() == 3 && next.get_position() == 2);
+        auto next_state = saved_state;
+        assert(next.redo(next_state) && next_state.get_pattern(1).get_velocity(V2i(5, 5)) == 10);
+        while (next.undo(next_state)) {}
+        std::vector<EditOp> ops;
+        diff_states(next_state, start, ops);
+        assert(ops.empty());
+
+        // the compacted log reads the same
+        UndoHistory from_compacted;
+        std::string compacted_again;
+        UndoLog::read(compacted, from_compacted, compacted_again);
+        assert(from_compacted.size() == 3 && from_compacted.get_position() == 2);
+        assert(from_compacted.ops() == next.ops());
+
+        // unsaved records of a session are dropped, a session on a changed project drops everything
+        state.get_pattern(0).clear_cell(V2i(0, 3));
+        history.push("erase", state, 4.0);
+        UndoLog::write_journal(history, log);
+        UndoLog::write_opened(2, log);
+        UndoHistory unsaved;
+        UndoLog::read(log, unsaved, compacted);
+        assert(unsaved.size() == 3 && unsaved.get_position() == 2);
+        UndoLog::write_opened(3, log);
+        UndoHistory changed;
+        UndoLog::read(log, changed, compacted);
+        assert(changed.size() == 0);
+
+        // a torn last line is skipped and many small records compact
+        std::string churn;
+        UndoLog::write_opened(1, churn);
+        UndoHistory churning;
+        churning.set_journaling(true);
+        churning.reset(start);
+        state = start;
+        for (int i = 0; i < 200; i++) {
+            state.get_pattern(0).set_velocity(V2i(i % 16, 0), (uint8_t) (1 + i % 100));
+            churning.push("velocity", state, (double) i);
+            churning.undo(state);
+            churning.redo(state);
+        }
+        churning.set_max_ops(40);
+        UndoLog::write_journal(churning, churn);
+        UndoLog::write_saved(4, churn);
+        churn += "{\"e\":\"push\",\"d\":\"dr";
+        UndoHistory churned(UndoHistory::DEFAULT_BUDGET_BYTES, UndoHistory::DEFAULT_COALESCE_SECONDS, 40);
+        assert(UndoLog::read(churn, churned, compacted));
+        assert(churned.size() == churning.size() && churned.ops() <= 40);
+        assert(compacted.size() * 4 < churn.size());
+    }
+}
@@ -0,0 +1,227 @@
+//
+// Created by Arunas on 16/10/2026.
+//
+
+#ifndef MY_PLUGINS_UNDO_HPP
+#define MY_PLUGINS_UNDO_HPP
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+#include "Patterns.hpp"
+#include "Edits.hpp"
+
+namespace myseq {
+
+    void test_undo();
+
+    void test_undo_log();
+
+    // Undo and redo as edit ops between the states recorded with push(). An entry keeps the ops
+    // that redo it and the ops that undo it, which for a typical edit is a few cells instead of a
+    // copy of the project. The oldest entries are dropped to stay within the byte budget.
+    class UndoHistory {
+    public:
+        struct Entry {
+            std::string descr;
+            // of the last push that went into this entry
+            double time;
+            std::vector<EditOp> forward;
+            std::vector<EditOp> backward;
+
+            [[nodiscard]] std::size_t bytes() const {
+                return sizeof(Entry) + descr.capacity()
+                       + (forward.capacity() + backward.capacity()) * sizeof(EditOp);
+            }
+
+            [[nodiscard]] std::size_t ops() const {
+                return forward.size() + backward.size();
+            }
+        };
+
+        // What happened to the entries, in order, so that it can be replayed on another history
+        struct Record {
+            enum class Kind : uint8_t {
+                Push,   // drop the redo entries, then add entry
+                Pop,    // drop the redo entries, then the last entry
+                Undo,
+                Redo,
+            };
+            Kind kind;
+            Entry entry;
+        };
+
+        static constexpr std::size_t DEFAULT_BUDGET_BYTES = 8 * 1024 * 1024;
+        static constexpr std::size_t DEFAULT_MAX_OPS = 100000;
+        // pushes with the same description this close to each other become one entry
+        static constexpr double DEFAULT_COALESCE_SECONDS = 0.5;
+
+    private:
+        // the state after entries[0] .. entries[position - 1]
+        State recorded;
+        std::deque<Entry> entries;
+        std::size_t position = 0;
+        std::size_t budget_bytes;
+        std::size_t total_bytes = 0;
+        std::size_t max_ops;
+        std::size_t total_ops = 0;
+        double coalesce_seconds;
+        bool journaling = false;
+        std::vector<Record> journal;
+
+        void apply(const std::vector<EditOp> &ops, State &state);
+
+        void enforce_budget();
+
+        void drop_redo_entries();
+
+        void add_entry(Entry &&entry);
+
+        void remove_last_entry();
+
+    public:
+        explicit UndoHistory(std::size_t budget_bytes = DEFAULT_BUDGET_BYTES,
+                             double coalesce_seconds = DEFAULT_COALESCE_SECONDS,
+                             std::size_t max_ops = DEFAULT_MAX_OPS)
+                : budget_bytes(budget_bytes), max_ops(max_ops), coalesce_seconds(coalesce_seconds) {}
+
+        // Forgets all entries and the journal, state is where undo stops
+        void reset(const State &state);
+
+        // Forgets all entries but keeps the recorded state
+        void drop_entries();
+
+        // Applies a record to the entries only, the recorded state stays as it is
+        void replay(const Record &record);
+
+        // Takes the entries of other, which was replayed up to the recorded state of this history
+        void take_entries(UndoHistory &&other);
+
+        // While on, every change to the entries is also kept as a record until drain_journal()
+        void set_journaling(bool on) {
+            journaling = on;
+            journal.clear();
+        }
+
+        template<typename F>
+        void drain_journal(F f) {
+            for (const auto &r: journal) {
+                f(r);
+            }
+            journal.clear();
+        }
+
+        // Records what changed since the last push as an entry and drops the redo entries.
+        // Returns false when nothing did, moving the cursor or scrolling alone is not worth an entry
+        bool push(const char *descr, const State &state, double time);
+
+        // Set state to the one before the last entry, unrecorded changes are lost like with any undo.
+        // The ImGui settings of state are kept
+        bool undo(State &state);
+
+        bool redo(State &state);
+
+        [[nodiscard]] bool can_undo() const {
+            return position > 0;
+        }
+
+        [[nodiscard]] bool can_redo() const {
+            return position < entries.size();
+        }
+
+        void set_budget_bytes(std::size_t new_budget_bytes) {
+            budget_bytes = new_budget_bytes;
+            enforce_budget();
+        }
+
+        [[nodiscard]] std::size_t get_budget_bytes() const {
+            return budget_bytes;
+        }
+
+        // Caps the edit ops kept over all entries, the oldest entries are dropped first
+        void set_max_ops(std::size_t new_max_ops) {
+            max_ops = new_max_ops;
+            enforce_budget();
+        }
+
+        [[nodiscard]] std::size_t get_max_ops() const {
+            return max_ops;
+        }
+
+        [[nodiscard]] std::size_t ops() const {
+            return total_ops;
+        }
+
+        [[nodiscard]] std::size_t bytes() const {
+            return total_bytes;
+        }
+
+        [[nodiscard]] std::size_t size() const {
+            return entries.size();
+        }
+
+        // Number of entries that can be undone, entries from there on can be redone
+        [[nodiscard]] std::size_t get_position() const {
+            return position;
+        }
+
+        template<typename F>
+        void each_entry(F f) const {
+            for (const auto &e: entries) {
+                f(e);
+            }
+        }
+    };
+
+    // Keeps the undo history of a project next to it in <project>.undo, one JSON record per line.
+    // Lines are only ever appended: every save of the project appends what the history did since
+    // the last one, followed by the State::content_hash() of what was saved. A session starts with the
+    // hash of the state it opened, and the older sessions are only kept when that is what the last one saved.
+    // The hash is that of the content, not of the file or host bytes, which differ between JSON and binary
+    //
+    // Older sessions are read on the first load(), the log is rewritten from the history when
+    // it holds much more than the history kept.
+    class UndoLog {
+        std::string path;
+        bool loaded = false;
+
+    public:
+        // a log larger than this per op the history may keep is read and rewritten when opened
+        static constexpr std::size_t COMPACT_BYTES_PER_OP = 64;
+
+        // Appends the journal of history as lines to out and clears it
+        static void write_journal(UndoHistory &history, std::string &out);
+
+        // Appends lines that rebuild the entries and position of history
+        static void write_entries(const UndoHistory &history, std::string &out);
+
+        static void write_opened(uint64_t project_hash, std::string &out);
+
+        static void write_saved(uint64_t project_hash, std::string &out);
+
+        // Replays the lines of log into the entries of history. Fills compacted with a shorter log
+        // that reads the same and returns true when log is worth rewriting
+        static bool read(const std::string &log, UndoHistory &history, std::string &compacted);
+
+        // Starts a session on the log of project_filename, history is journaled from here on
+        void open(const std::string &project_filename, uint64_t project_hash, UndoHistory &history);
+
+        // Starts a new log for project_filename with the entries of history, as for save as
+        void create(const std::string &project_filename, UndoHistory &history);
+
+        void close(UndoHistory &history);
+
+        [[nodiscard]] bool is_open() const {
+            return !path.empty();
+        }
+
+        // After the project was saved with this hash
+        void write(UndoHistory &history, uint64_t project_hash);
+
+        // Reads the older sessions into history, only the first call after open() does something
+        void load(UndoHistory &history);
+    };
+}
+
+#endif //MY_PLUGINS_UNDO_HPP
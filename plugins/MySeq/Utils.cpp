@@ -24,4 +24,9 @@ std::optional<std::string> read_file(const char *filename) {
 void write_file(const char *filename, const char *data, size_t size) {
     std::ofstream out(filename);
     out.write(data, size);
-}
\ No newline at end of file
+}
+
+void append_file(const char *filename, const char *data, size_t size) {
+    std::ofstream out(filename, std::ios::app);
+    out.write(data, size);
+}
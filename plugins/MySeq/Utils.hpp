@@ -17,4 +17,6 @@ std::optional<std::string> read_file(const char *filename);
 
 void write_file(const char *filename, const char *data, size_t size);
 
+void append_file(const char *filename, const char *data, size_t size);
+
 #endif //MY_PLUGINS_UTILS_HPP
@@ -152,7 +152,7 @@ RAPIDJSON_NAMESPACE_BEGIN
         size_t offset_;
     };
 
-    ParseResult::ParseResult() : code_(kParseErrorNone), offset_(0) {}
+    inline ParseResult::ParseResult() : code_(kParseErrorNone), offset_(0) {}
 
 //! Function pointer type of GetParseError().
 /*! \ingroup RAPIDJSON_ERRORS